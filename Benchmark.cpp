@@ -0,0 +1,374 @@
+#include "UnitConverter.h"
+#include "FMEmulator.h"
+#include <chrono>
+#include <iomanip>
+#include <cstdio>
+#include <random>
+#ifdef __unix__
+#include <sys/resource.h>
+#endif
+
+typedef UnitConverter::Digraph Digraph;
+typedef std::chrono::steady_clock Clock;
+
+//Options of the generated workloads: the case to run (all of them if empty), the size and the seed
+struct Workload {
+	std::string name;
+	std::size_t size;
+	unsigned seed;
+};
+
+//Random number below n, the generators use the raw engine output to be the same on every platform
+static std::size_t Random(std::mt19937 &rng, std::size_t n) {return rng() % n;}
+
+//Peak resident set size of the process in megabytes (-1 where it is not available),
+//run a single case per process to get its own peak
+static double PeakRSS() {
+#ifdef __unix__
+	struct rusage ru;
+	if(!getrusage(RUSAGE_SELF, &ru)) return ru.ru_maxrss / 1024.0;
+#endif
+	return -1.0;
+}
+
+//Latencies of single operations, reported as percentiles
+class Latencies {
+public:
+	void Add(double t) {samples_.push_back(t);}
+	//Get the p-th percentile (the samples get sorted)
+	double Get(double p) {
+		if(samples_.empty()) return 0.0;
+		std::sort(samples_.begin(), samples_.end());
+		return samples_[std::min(samples_.size() - 1, static_cast<std::size_t>(p / 100.0 * samples_.size()))];
+	}
+	std::size_t GetCount() const {return samples_.size();}
+private:
+	std::vector<double> samples_;
+};
+
+static double Seconds(Clock::time_point start) {return std::chrono::duration<double>(Clock::now() - start).count();}
+
+//The recursive DFS path search used by UnitConverter before, kept for the comparison
+static bool LegacyFindPath(const Digraph &g, Digraph::Vertex v1, Digraph::Vertex v2, Digraph::Path &path) {
+	path.push_back(v1);
+	if(v1 == v2) return true;
+	const Digraph::Edges &e = g.GetArcs(v1);
+	for(Digraph::Edges::const_iterator i = e.begin(), last = e.end(); i != last; ++i)
+		if(v1 != i->to && find(path.begin(), path.end(), i->to) == path.end() && LegacyFindPath(g, i->to, v2, path))
+			return true;
+	path.pop_back();
+	return false;
+}
+
+//Builds a chain of n equal units, with the shortcut
+//the last unit is directly related to the first one as well
+static void MakeChain(Digraph &g, std::size_t n, bool shortcut) {
+	g.MakeEmpty();
+	for(std::size_t i = 0; i < n; ++i) g.AddVertex();
+	for(std::size_t i = 1; i < n; ++i) {
+		g.SetWeight(i - 1, i, 1.0);
+		g.SetWeight(i, i - 1, 1.0);
+	}
+	if(shortcut) {
+		g.SetWeight(0, n - 1, 1.0);
+		g.SetWeight(n - 1, 0, 1.0);
+	}
+}
+
+//Runs the path search from the first to the last vertex, returns microseconds per search
+template<class Search>
+static double TimeSearch(Search search, std::size_t reps, std::size_t &hops) {
+	Digraph::Path path;
+	Clock::time_point start = Clock::now();
+	for(std::size_t r = 0; r < reps; ++r) {
+		path.clear();
+		if(!search(path)) {hops = 0; return -1.0;}
+	}
+	hops = path.size() - 1;
+	return std::chrono::duration<double, std::micro>(Clock::now() - start).count() / reps;
+}
+
+//Compares the legacy recursive DFS against Digraph::GetPath on deep chains,
+//the legacy search is skipped where its recursion depth would blow the stack
+static void BenchPaths() {
+	const std::size_t depths[] = {1000, 4000, 16000, 250000, 1000000};
+	const std::size_t MaxLegacyDepth = 16000, Reps = 10;
+	std::cout << "shape        depth     bfs us   bfs hops  legacy us  legacy hops\n";
+	for(int shortcut = 0; shortcut < 2; ++shortcut)
+		for(std::size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); ++d) {
+			Digraph g;
+			std::size_t n = depths[d], hops;
+			MakeChain(g, n, shortcut != 0);
+			std::cout << (shortcut ? "chain+short" : "chain      ") << std::setw(10) << n;
+			std::cout << std::setw(11) << std::fixed << std::setprecision(1)
+			          << TimeSearch([&](Digraph::Path &p) {return g.GetPath(0, n - 1, p);}, Reps, hops);
+			std::cout << std::setw(11) << hops;
+			if(n <= MaxLegacyDepth) {
+				std::cout << std::setw(11)
+				          << TimeSearch([&](Digraph::Path &p) {return LegacyFindPath(g, 0, n - 1, p);}, Reps, hops);
+				std::cout << std::setw(13) << hops << "\n";
+			}
+			else std::cout << std::setw(11) << "-" << std::setw(13) << "-" << "\n";
+		}
+}
+
+//Writes the rules relating n units in the shape and the requests between random units into the file,
+//the same ratios are set in the graph: chain - each unit to the next one, star - each unit to the first one,
+//components - a forest of 1000-unit random trees (the requests across the trees have no conversion)
+static void MakeRules(const std::string &file, const std::string &shape, std::size_t n, unsigned seed, Digraph &g) {
+	std::mt19937 rng(seed);
+	std::ofstream ofs(file.c_str(), std::ios::binary);
+	std::size_t trees = std::max<std::size_t>(1, n / 1000);
+	g.MakeEmpty();
+	for(std::size_t i = 0; i < n; ++i) g.AddVertex();
+	for(std::size_t i = 1; i < n; ++i) {
+		std::size_t j;
+		if(shape == "chain") j = i - 1;
+		else if(shape == "star") j = 0;
+		else if(i < trees) continue;
+		else j = i % trees + trees * Random(rng, i / trees);
+		//the ratios are 2 or 1/2, the factors of long paths stay in range
+		bool up = Random(rng, 2) != 0;
+		ofs << (up ? "1 u" : "2 u") << j << " = " << (up ? "2 u" : "1 u") << i << "\n";
+		g.SetWeight(j, i, up ? 2.0 : 0.5);
+		g.SetWeight(i, j, up ? 0.5 : 2.0);
+	}
+	for(std::size_t i = 0; i < n; ++i) ofs << "1 u" << Random(rng, n) << " = ? u" << Random(rng, n) << "\n";
+}
+
+//Measures reading the rules and the requests, writing the results, and the latencies of the path search
+//and of the index lookups between random units
+static void BenchRules(const Workload &w) {
+	const char *shapes[] = {"chain", "star", "components"};
+	const std::string input = "bench_uc_in.txt", output = "bench_uc_out.txt";
+	std::cout << "shape          units  read Mline/s  write Mreq/s  path p50/p99 us  index p50/p99 ns  conv %  peak MB\n";
+	for(std::size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); ++s) {
+		if(!w.name.empty() && w.name != shapes[s]) continue;
+		Digraph g;
+		MakeRules(input, shapes[s], w.size, w.seed, g);
+		UnitConverter uc;
+		Clock::time_point start = Clock::now();
+		uc.ReadInput(input);
+		double read = Seconds(start);
+		start = Clock::now();
+		uc.MakeOutput(output);
+		double write = Seconds(start);
+
+		//the path searches are timed one by one, the index lookups in groups of 64 (a lookup is shorter than the clock's resolution)
+		std::mt19937 rng(w.seed + 1);
+		Latencies path, index;
+		Digraph::Path p;
+		for(std::size_t i = 0; i < 200; ++i) {
+			Digraph::Vertex v1 = Random(rng, w.size), v2 = Random(rng, w.size);
+			Clock::time_point t = Clock::now();
+			g.GetPath(v1, v2, p);
+			path.Add(std::chrono::duration<double, std::micro>(Clock::now() - t).count());
+		}
+		g.BuildIndex();
+		Digraph::Vertex v[128];
+		double f;
+		std::size_t found = 0;
+		for(std::size_t i = 0; i < 20000; ++i) {
+			for(std::size_t k = 0; k < 128; ++k) v[k] = Random(rng, w.size);
+			Clock::time_point t = Clock::now();
+			for(std::size_t k = 0; k < 128; k += 2) found += g.GetFactor(v[k], v[k + 1], f);
+			index.Add(std::chrono::duration<double, std::nano>(Clock::now() - t).count() / 64);
+		}
+		std::cout << std::left << std::setw(12) << shapes[s] << std::right << std::setw(8) << w.size << std::fixed
+		          << std::setprecision(2) << std::setw(15) << 2 * w.size / read / 1e6 << std::setw(14) << w.size / write / 1e6
+		          << std::setprecision(1) << std::setw(9) << path.Get(50) << "/" << std::left << std::setw(8) << path.Get(99) 
+		          << std::right << std::setw(10) << index.Get(50) << "/" << std::left << std::setw(7) << index.Get(99)
+		          << std::right << std::setw(8) << 100.0 * found / index.GetCount() / 64 << std::setw(9) << PeakRSS() << "\n";
+	}
+	std::remove(input.c_str());
+	std::remove(output.c_str());
+}
+
+//Measures the bulk conversions of n values between the units of a 16-unit chain: column - the values of one pair
+//of units, triples - the conversions of random pairs grouped by 4096, single - ConvertValue per value for the comparison;
+//the bandwidth counts the bytes of the values read and the results written
+static void BenchBulk(const Workload &w) {
+	const char *cases[] = {"column", "triples", "single"};
+	const std::size_t Units = 16, Group = 4096;
+	UnitConverter uc;
+	for(std::size_t i = 1; i < Units; ++i) uc.SetRule("u" + std::to_string(i - 1), 1.0, "u" + std::to_string(i), 2.0);
+	std::mt19937 rng(w.seed);
+	std::vector<double> src(w.size), dst(w.size);
+	std::vector<UnitConverter::Conversion> conv(w.size);
+	for(std::size_t i = 0; i < w.size; ++i) src[i] = Random(rng, 1000000) / 1000.0;
+	for(std::size_t i = 0; i < w.size; i += Group) {
+		UnitConverter::UnitId from = uc.GetUnitId("u" + std::to_string(Random(rng, Units)));
+		UnitConverter::UnitId to = uc.GetUnitId("u" + std::to_string(Random(rng, Units)));
+		for(std::size_t k = i; k < std::min(w.size, i + Group); ++k) {
+			conv[k].value = src[k];
+			conv[k].from = from;
+			conv[k].to = to;
+		}
+	}
+	std::cout << "case          values   Mvalue/s     GB/s\n";
+	for(std::size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+		if(!w.name.empty() && w.name != cases[c]) continue;
+		std::size_t bytes = 2 * sizeof(double);
+		Clock::time_point start = Clock::now();
+		if(c == 0) uc.ConvertValues("u0", "u15", src.data(), dst.data(), w.size);
+		else if(c == 1) {
+			uc.ConvertValues(conv.data(), w.size, dst.data());
+			bytes = sizeof(UnitConverter::Conversion) + sizeof(double);
+		}
+		else for(std::size_t i = 0; i < w.size; ++i) uc.ConvertValue(src[i], "u0", "u15", dst[i]);
+		double t = Seconds(start);
+		std::cout << std::left << std::setw(8) << cases[c] << std::right << std::setw(12) << w.size << std::fixed
+		          << std::setprecision(1) << std::setw(11) << w.size / t / 1e6 << std::setprecision(2) << std::setw(9) 
+		          << bytes * w.size / t / 1e9 << "\n";
+	}
+}
+
+//Writes about n commands of the shape into the file: deep - chains of nested directories and files addressed
+//by absolute paths, wide - a few directories with many files, half of them deleted, churn - projects whose files
+//get dynamic and hard links, which are deleted, a directory moved back and forth, copies of directories (with the links)
+//made and deleted; the commands never fail
+static void MakeBatch(const std::string &file, const std::string &shape, std::size_t n, unsigned seed) {
+	std::mt19937 rng(seed);
+	std::ofstream ofs(file.c_str(), std::ios::binary);
+	std::size_t count = 0;
+	if(shape == "deep") {
+		const std::size_t Depth = 48;
+		for(std::size_t c = 0; count < n; ++c) {
+			std::string path = "C:\\c" + std::to_string(c);
+			ofs << "md " << path << "\n";
+			for(std::size_t d = 0; d < Depth; ++d, count += 2) {
+				ofs << "mf " << path << "\\f" << Random(rng, 100) << ".txt\n";
+				path += "\\d" + std::to_string(d);
+				ofs << "md " << path << "\n";
+			}
+		}
+	}
+	else if(shape == "wide") {
+		const std::size_t Dirs = 4;
+		std::size_t files = 2 * n / 3 / Dirs + 1;
+		for(std::size_t d = 0; d < Dirs; ++d) ofs << "md C:\\w" << d << "\n";
+		for(std::size_t f = 0; f < files; ++f)
+			for(std::size_t d = 0; d < Dirs; ++d) ofs << "mf C:\\w" << d << "\\f" << f << ".txt\n";
+		for(std::size_t f = 0; f < files; f += 2)
+			for(std::size_t d = 0; d < Dirs; ++d) ofs << "del C:\\w" << d << "\\f" << f << ".txt\n";
+	}
+	else {
+		const std::size_t Projects = 8, Dirs = 16, Files = 8;
+		ofs << "md C:\\bk\n";
+		for(std::size_t p = 0; p < Projects; ++p) {
+			ofs << "md C:\\p" << p << "\nmd C:\\p" << p << "\\h0\nmd C:\\p" << p << "\\h1\n";
+			ofs << "md C:\\p" << p << "\\h0\\m\nmf C:\\p" << p << "\\h0\\m\\x.txt\n";
+			for(std::size_t d = 0; d < Dirs; ++d) {
+				ofs << "md C:\\p" << p << "\\d" << d << "\n";
+				for(std::size_t f = 0; f < Files; ++f) ofs << "mf C:\\p" << p << "\\d" << d << "\\f" << f << ".txt\n";
+			}
+		}
+		std::vector<std::string> links;
+		std::vector<int> holder(Projects, 0);
+		std::size_t copies = 0, deleted = 0;
+		for(; count < n; ++count) {
+			std::size_t r = Random(rng, 100), p = Random(rng, Projects);
+			std::string dir = "C:\\p" + std::to_string(Random(rng, Projects)) + "\\d" + std::to_string(Random(rng, Dirs));
+			if(r < 50) {
+				std::string src = "C:\\p" + std::to_string(p) + "\\d" + std::to_string(Random(rng, Dirs)) + "\\f" + std::to_string(Random(rng, Files)) + ".txt";
+				bool dynamic = r < 30;
+				ofs << (dynamic ? "mdl " : "mhl ") << src << " " << dir << "\n";
+				std::string lnk = dir + (dynamic ? "\\dlink[" : "\\hlink[") + src + "]";
+				if(std::find(links.begin(), links.end(), lnk) == links.end()) links.push_back(lnk);
+			}
+			else if(r < 70 && !links.empty()) {
+				std::size_t i = Random(rng, links.size());
+				ofs << "del " << links[i] << "\n";
+				links[i] = links.back();
+				links.pop_back();
+			}
+			else if(r < 85) {
+				ofs << "move C:\\p" << p << "\\h" << holder[p] << "\\m C:\\p" << p << "\\h" << 1 - holder[p] << "\n";
+				holder[p] = 1 - holder[p];
+			}
+			else if(r < 95) {
+				ofs << "md C:\\bk\\c" << copies << "\ncopy " << dir << " C:\\bk\\c" << copies << "\n";
+				++copies;
+				++count;
+			}
+			else if(deleted < copies) ofs << "deltree C:\\bk\\c" << deleted++ << "\n";
+		}
+	}
+}
+
+//Gives the benchmark the execution of single commands
+class BenchEmulator : public FileManagerEmulator {
+public:
+	using FileManagerEmulator::Execute;
+};
+
+//Measures the execution of the generated batches: the throughput of the whole batch file
+//(reading, parsing and executing) and the latencies of the single commands
+static void BenchBatch(const Workload &w) {
+	const char *shapes[] = {"deep", "wide", "churn"};
+	const std::string batch = "bench_fm.txt";
+	std::cout << "shape      commands  exec kcmd/s   cmd p50     p90     p99     max us  peak MB\n";
+	for(std::size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); ++s) {
+		if(!w.name.empty() && w.name != shapes[s]) continue;
+		MakeBatch(batch, shapes[s], w.size, w.seed);
+		double exec;
+		{
+			FileManagerEmulator fme;
+			Clock::time_point start = Clock::now();
+			if(fme.ExecBatchFile(batch) != FileManagerEmulator::stOk) std::cout << fme.GetLastError() << "\n";
+			exec = Seconds(start);
+		}
+		FileManagerEmulator::Program program;
+		BenchEmulator bench;
+		bench.CompileBatchFile(batch, program);
+		Latencies cmd;
+		for(std::size_t i = 0, n = program.GetSize(); i < n; ++i) {
+			FileManagerEmulator::Command c = program.Get(i);
+			Clock::time_point t = Clock::now();
+			bench.Execute(c);
+			cmd.Add(std::chrono::duration<double, std::micro>(Clock::now() - t).count());
+		}
+		std::cout << std::left << std::setw(8) << shapes[s] << std::right << std::setw(11) << program.GetSize() << std::fixed 
+		          << std::setprecision(1) << std::setw(14) << program.GetSize() / exec / 1e3 << std::setprecision(2)
+		          << std::setw(10) << cmd.Get(50) << std::setw(8) << cmd.Get(90) << std::setw(8) << cmd.Get(99) 
+		          << std::setw(10) << cmd.Get(100) << std::setprecision(1) << std::setw(9) << PeakRSS() << "\n";
+	}
+	std::remove(batch.c_str());
+}
+
+int main(int argc, char* argv[]) {
+	std::string suite = argc >= 2 ? argv[1] : "";
+	Workload w = {"", 0, 1};
+	bool valid = true;
+	for(int i = 2; i < argc; ++i) {
+		std::string opt(argv[i]);
+		if(opt == "-n" && i + 1 < argc) w.size = static_cast<std::size_t>(atol(argv[++i]));
+		else if(opt == "-s" && i + 1 < argc) w.seed = static_cast<unsigned>(atol(argv[++i]));
+		else if(opt[0] != '-' && w.name.empty()) w.name = opt;
+		else valid = false;
+	}
+	if(suite == "paths" && argc == 2) BenchPaths();
+	else if(suite == "rules" && valid) {
+		if(!w.size) w.size = 200000;
+		BenchRules(w);
+	}
+	else if(suite == "bulk" && valid) {
+		if(!w.size) w.size = 4000000;
+		BenchBulk(w);
+	}
+	else if(suite == "batch" && valid) {
+		if(!w.size) w.size = 200000;
+		BenchBatch(w);
+	}
+	else {
+		std::cout << "Usage: Benchmark.exe suite [case] [-n size] [-s seed]\n"
+		             "  paths  path search on deep unit chains (BFS vs the legacy recursive DFS)\n"
+		             "  rules  UnitConverter on generated rules: chain, star, components (size - units, default 200000)\n"
+		             "  bulk   UnitConverter bulk conversions: column, triples, single (size - values, default 4000000)\n"
+		             "  batch  FMEmulator on generated batches: deep, wide, churn (size - commands, default 200000)\n"
+		             "The workloads are the same for the same seed (default 1), the peak memory is the process's one,\n"
+		             "run a single case to get its own peak.\n";
+		system("pause");
+	}
+	return EXIT_SUCCESS;
+}
\ No newline at end of file
@@ -1,15 +1,98 @@
 #include "FMEmulator.h"
 
 int main(int argc, char* argv[]) {
-	if(argc == 2) {
+	bool verify = false, stats = false;
+	unsigned threads = 1;
+	FileManagerEmulator::ErrorMode mode = FileManagerEmulator::stopOnError;
+	std::string output, subtree, load, save, journal, json, pattern, usage;
+	size_t depth = FileManagerEmulator::AnyDepth;
+	int i = 1;
+	for(; i < argc && argv[i][0] == '-'; ++i) {
+		std::string opt(argv[i]);
+		if(opt == "-j" && i + 1 < argc) threads = static_cast<unsigned>(atoi(argv[++i]));
+		else if(opt == "-c") verify = true;
+		else if(opt == "-k") mode = FileManagerEmulator::continueOnError;
+		else if(opt == "-r") mode = FileManagerEmulator::rollbackOnError;
+		else if(opt == "-o" && i + 1 < argc) output = argv[++i];
+		else if(opt == "-p" && i + 1 < argc) subtree = argv[++i];
+		else if(opt == "-d" && i + 1 < argc) depth = static_cast<size_t>(atoi(argv[++i]));
+		else if(opt == "-l" && i + 1 < argc) load = argv[++i];
+		else if(opt == "-w" && i + 1 < argc) save = argv[++i];
+		else if(opt == "-a" && i + 1 < argc) journal = argv[++i];
+		else if(opt == "-t") stats = true;
+		else if(opt == "-J" && i + 1 < argc) json = argv[++i];
+		else if(opt == "-f" && i + 1 < argc) pattern = argv[++i];
+		else if(opt == "-u" && i + 1 < argc) usage = argv[++i];
+		else break;
+	}
+	if(1 == argc - i) {
 		FileManagerEmulator fme;
-		fme.ExecBatchFile(argv[1]);
-		fme.Print();
+		if(verify) {
+			bool same = fme.VerifyBatchFile(argv[i], threads);
+			std::cout << (same ? "The parallel execution matches the serial one.\n" : "The parallel execution differs from the serial one!\n");
+			return same ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+		if(load.length() && fme.LoadSnapshot(load) != FileManagerEmulator::stOk)
+			FileManagerEmulator::ErrorMsg(fme.GetLastError() + ", the program will terminate.");
+		if(journal.length() && fme.OpenJournal(journal) != FileManagerEmulator::stOk)
+			FileManagerEmulator::ErrorMsg(fme.GetLastError() + ", the program will terminate.");
+		FileManagerEmulator::Status st = fme.ExecBatchFile(argv[i], threads, mode);
+		for(size_t k = 0; k < fme.GetErrors().size(); ++k) std::cout << fme.GetErrors()[k] << "\n";
+		if(st != FileManagerEmulator::stOk) {
+			if(mode == FileManagerEmulator::stopOnError) 
+				FileManagerEmulator::ErrorMsg(fme.GetLastError() + ", the program will terminate.");
+			if(mode == FileManagerEmulator::rollbackOnError) 
+				std::cout << fme.GetLastError() << ", the changes are rolled back to the last checkpoint.\n";
+		}
+		if(save.length() && fme.SaveSnapshot(save) != FileManagerEmulator::stOk)
+			FileManagerEmulator::ErrorMsg(fme.GetLastError() + ", the program will terminate.");
+		st = FileManagerEmulator::stOk;
+		if(pattern.length()) {
+			std::vector<std::string> paths;
+			st = fme.Find(pattern, paths, subtree);
+			for(size_t k = 0; k < paths.size(); ++k) std::cout << paths[k] << "\n";
+		}
+		else if(usage.length()) {
+			FileManagerEmulator::Usage u;
+			if((st = fme.GetUsage(usage, u)) == FileManagerEmulator::stOk)
+				std::cout << "files: " << u.files << ", directories: " << u.directories 
+				          << ", hard links: " << u.hardlinks << ", dynamic links: " << u.dynlinks << "\n";
+		}
+		else if(output.length()) st = fme.PrintToFile(output, subtree, depth);
+		else if(subtree.length()) st = fme.PrintSubtree(subtree, std::cout, depth);
+		else fme.Print(std::cout, depth);
+		if(st != FileManagerEmulator::stOk) FileManagerEmulator::ErrorMsg(fme.GetLastError() + ", the program will terminate.");
+		if((stats || json.length()) && !FileManagerEmulator::HasStats()) 
+			std::cout << "The instrumentation is not compiled in (define FM_STATS to enable it).\n";
+		else {
+			if(stats) fme.PrintStats();
+			if(json.length()) {
+				std::ofstream ofs(json.c_str());
+				fme.WriteStatsJson(ofs);
+				if(!ofs) FileManagerEmulator::ErrorMsg("Cannot write to " + json + " file, the program will terminate.");
+			}
+		}
 	}
 	else {
-		std::cout << "Usage: FMEmulator.exe batch_file_path\n";
+		std::cout << "Usage: FMEmulator.exe [-j threads [-c]] [-k | -r] [-p path] [-d depth] [-o output_file]\n"
+		             "                    [-l snapshot] [-a journal] [-w snapshot] [-t] [-J stats_file]\n"
+		             "                    [-f pattern | -u path] batch_file_path\n"
+		             "  -j  number of threads executing the commands of independent directories (0 - one per core, default 1)\n"
+		             "  -c  check that the parallel execution makes the same tree as the serial one\n"
+		             "  -k  continue after a failed command (a failed transaction is rolled back and skipped)\n"
+		             "  -r  roll back to the last checkpoint after a failed command and stop\n"
+		             "  -p  print the directory (or file) of the path only\n"
+		             "  -d  print the tree down to the depth (the printed directory is at the depth 0)\n"
+		             "  -o  write the tree to the file\n"
+		             "  -l  load the tree from a snapshot before executing the batch\n"
+		             "  -a  replay the journal (after the snapshot) and append the executed commands to it\n"
+		             "  -w  save the tree into a snapshot after executing the batch (the journal is emptied)\n"
+		             "  -t  print the commands' latencies and the counters of the instrumentation (built with FM_STATS)\n"
+		             "  -J  export the counters of the instrumentation as JSON (built with FM_STATS)\n"
+		             "  -f  print the paths of the nodes matching the pattern (* and ? wildcards) instead of the tree,\n"
+		             "      the ones below the directory given by -p only\n"
+		             "  -u  print the counts of the files, directories and links below the directory instead of the tree\n";
 		system("pause");
 	}
 	return EXIT_SUCCESS;
-}
-
+}
\ No newline at end of file
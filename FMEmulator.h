@@ -4,319 +4,964 @@
 #include <algorithm>
 #include <iostream>
 #include <fstream>
-#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <set>
 #include <map>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include "IOUtils.h"
+
+//the instrumentation (the commands' latencies, the walks, the touched nodes, the allocations) is compiled in
+//when FM_STATS is defined, otherwise the statements recording it expand to nothing
+#ifdef FM_STATS
+#define FM_STAT(statement) do {statement;} while(0)
+#else
+#define FM_STAT(statement) do {} while(0)
+#endif
 
 using std::set;
 using std::map;
 using std::string;
+using std::string_view;
 using std::vector;
 using std::endl;
 using std::cout;
 using std::cin;
 using std::ifstream;
-using std::stringstream;
+using std::ofstream;
+using std::ostream;
 using std::find;
 using std::reverse;
-using std::getline;
 
 class FileManagerEmulator {
 public:
 	//constructs the object
-	FileManagerEmulator() : root_(File("C:", File::directory)), curdir_("C:") {}
+	FileManagerEmulator() : root_("C:", File::directory), curdir_("C:"), curnode_(0), parallel_(false) {}
 	//destructs the object
-	virtual ~FileManagerEmulator() {DelDir(&root_);}
-
-	//executes batch file, containing supported commands' execution order
-	void ExecBatchFile(const string &inFile) {
-		ifstream ifs(inFile.c_str());
-		if(ifs.fail()) 
-			ErrorMsg("Cannot read from " + inFile + " file, the program will terminate.");
-
-		stringstream ss;
-		for(string s, cmd, arg1, arg2; getline(ifs, s); ) {
-			ss.clear();
-			ss.str(s);
-			ss >> cmd >> arg1 >> arg2;
-
-			ToLower(cmd);
-			if(cmd == "md") MakeDirectory(arg1);
-			else if(cmd == "cd") ChangeCurDirectory(arg1);
-			else if(cmd == "rd") RemoveDirectory(arg1);
-			else if(cmd == "deltree") DeleteTree(arg1);
-			else if(cmd == "mf") MakeFile(arg1);
-			else if(cmd == "mhl") MakeHardLink(arg1, arg2);
-			else if(cmd == "mdl") MakeDynamicLink(arg1, arg2);
-			else if(cmd == "del") DeleteFile(arg1);
-			else if(cmd == "copy") CopyFile(arg1, arg2);
-			else if(cmd == "move") MoveFile(arg1, arg2);
+	virtual ~FileManagerEmulator() {root_.Clear(0);}
+
+	//codes of the commands, the last three group the commands into transactions and mark the checkpoints
+	enum Opcode {opNone, opMD, opCD, opRD, opDelTree, opMF, opMHL, opMDL, opDel, opCopy, opMove, opBegin, opCommit, opCheckpoint};
+	//results of the commands
+	enum Status {stOk, stBadPath, stBadName, stNotFound, stHardLinks, stCurrentDir, stIntoItself, stNoTransaction, stCannotRead, stCannotWrite, stBadSnapshot, stInTransaction};
+	//reaction of the batch execution to a failed command: stop (the changes of the batch's unfinished transactions 
+	//are rolled back), continue (a failed transaction is rolled back and skipped), roll back to the last checkpoint and stop
+	enum ErrorMode {stopOnError, continueOnError, rollbackOnError};
+	//command of the batch file, the arguments are views into the line or the program
+	struct Command {
+		Opcode op;
+		string_view arg1, arg2;
+	};
+	//batch file compiled into the commands, it can be executed repeatedly
+	class Program {
+	public:
+		//appends the command, its arguments are copied
+		void Add(const Command &c) {
+			Instruction i = {c.op, text_.size(), c.arg1.size(), text_.size() + c.arg1.size(), c.arg2.size()};
+			text_.append(c.arg1).append(c.arg2);
+			code_.push_back(i);
+		}
+		Command Get(size_t i) const {
+			const Instruction &ins = code_[i];
+			Command c = {ins.op, string_view(text_.data() + ins.arg1, ins.len1), string_view(text_.data() + ins.arg2, ins.len2)};
+			return c;
+		}
+		inline size_t GetSize() const {return code_.size();}
+		inline void Clear() {code_.clear(); text_.clear();}
+	private:
+		//the arguments are kept in one string
+		struct Instruction {
+			Opcode op;
+			size_t arg1, len1, arg2, len2;
+		};
+		vector<Instruction> code_;
+		string text_;
+	};
+
+	//executes batch file, containing supported commands' execution order, the file is read by large blocks
+	//and executed while reading, the runs of commands working in different top-level directories can be
+	//executed by the given number of threads (0 - one per hardware thread), the result is the same as of serial execution,
+	//returns the status of the first failed command (its message is given by GetLastError),
+	//in the continue mode the messages of all the failed commands are given by GetErrors
+	Status ExecBatchFile(const string &inFile, unsigned threads = 1, ErrorMode mode = stopOnError) {
+		LineReader reader(inFile);
+		if(!reader.IsOpen()) return Fail(stCannotRead, "Cannot read from " + inFile + " file");
+		return Run([&reader](Command &c) {
+			for(string_view line; reader.GetLine(line); )
+				if(ParseCommand(line, c)) return true;
+			return false;
+		}, threads, mode);
+	}
+	//compiles the batch file into the program
+	Status CompileBatchFile(const string &inFile, Program &program) {
+		LineReader reader(inFile);
+		if(!reader.IsOpen()) return Fail(stCannotRead, "Cannot read from " + inFile + " file");
+		Command c;
+		for(string_view line; reader.GetLine(line); )
+			if(ParseCommand(line, c)) program.Add(c);
+		return stOk;
+	}
+	//executes the compiled batch file (as ExecBatchFile does)
+	Status ExecProgram(const Program &program, unsigned threads = 1, ErrorMode mode = stopOnError) {
+		size_t i = 0, n = program.GetSize();
+		return Run([&program, &i, n](Command &c) {
+			if(i == n) return false;
+			c = program.Get(i++);
+			return true;
+		}, threads, mode);
+	}
+	//executes the batch file on the threads and serially (by another emulator),
+	//returns true if both of them made the same tree
+	bool VerifyBatchFile(const string &inFile, unsigned threads) {
+		Program program;
+		if(CompileBatchFile(inFile, program) != stOk) return false;
+		FileManagerEmulator serial;
+		serial.ExecProgram(program);
+		ExecProgram(program, threads);
+		return SameTree(&root_, &serial.root_);
+	}
+
+	//starts a transaction, the changes made till its commit can be rolled back (the transactions can be nested),
+	//the commands are executed serially within the transactions
+	void BeginTransaction() {marks_.push_back(Mark(log_.size(), pending_.size()));}
+	//commits the innermost transaction, the changes become permanent (and journaled) when the outermost one is committed
+	Status CommitTransaction() {
+		if(marks_.empty()) return Fail(stNoTransaction, "COMMIT failed! There is no transaction");
+		marks_.pop_back();
+		if(marks_.empty()) {
+			Finalize(log_, 0);
+			WriteJournal();
+		}
+		return stOk;
+	}
+	//rolls the innermost transaction back
+	Status RollbackTransaction() {
+		if(marks_.empty()) return Fail(stNoTransaction, "ROLLBACK failed! There is no transaction");
+		Undo(log_, marks_.back().log);
+		pending_.resize(marks_.back().journal);
+		marks_.pop_back();
+		return stOk;
+	}
+	//gets the message of the last failed command (of the first failed one of a batch)
+	inline const string &GetLastError() const {return error_;}
+	//gets the messages of the commands of the last batch failed in the continue mode, in the batch order
+	inline const vector<string> &GetErrors() const {return errors_;}
+
+	//counters of the instrumentation (all zeros unless it is compiled in by FM_STATS)
+	struct Stats {
+		//executions of a command: the count, the failed ones, the total time, the histogram of the latencies
+		//(the k-th bucket counts the executions taking from 2^k to 2^(k+1) ns)
+		struct Command {
+			std::uint64_t count, failed, time, buckets[40];
+		};
+		Command commands[opMove + 1];
+		//paths walked: the count, the directories passed, the deepest walk
+		std::uint64_t walks, steps, maxDepth;
+		//nodes copied by COPY, subtrees shared instead, shared nodes copied before a change
+		std::uint64_t copied, shared, unshared;
+		//nodes removed from their directories and the nodes with links visited by the removals
+		std::uint64_t removed, visited;
+		//links made and removed
+		std::uint64_t links, unlinks;
+
+		Stats() {std::memset(this, 0, sizeof(*this));}
+		//adds the counters of another thread
+		void Add(const Stats &s) {
+			std::uint64_t depth = std::max(maxDepth, s.maxDepth);
+			const std::uint64_t *src = reinterpret_cast<const std::uint64_t *>(&s);
+			std::uint64_t *dst = reinterpret_cast<std::uint64_t *>(this);
+			for(size_t i = 0; i < sizeof(*this) / sizeof(std::uint64_t); ++i) dst[i] += src[i];
+			maxDepth = depth;
 		}
+		//gets the upper bound of the latency's percentile (ns) from the histogram
+		static std::uint64_t GetPercentile(const Command &c, double p) {
+			std::uint64_t rank = static_cast<std::uint64_t>(p / 100.0 * c.count), seen = 0;
+			for(size_t k = 0; k < 40; ++k)
+				if((seen += c.buckets[k]) > rank) return std::uint64_t(2) << k;
+			return 0;
+		}
+	};
+	//counters of the allocations from the pools: the blocks allocated, freed and the bytes reserved by the pools
+	struct PoolStats {
+		std::atomic<std::uint64_t> allocated, freed, reserved;
+	};
+	//checks if the instrumentation is compiled in
+	static bool HasStats() {
+#ifdef FM_STATS
+		return true;
+#else
+		return false;
+#endif
+	}
+	inline const Stats &GetStats() const {return stats_;}
+	inline void ResetStats() {stats_ = Stats();}
+	//the pools are shared by all the emulators
+	static PoolStats &GetPoolStats() {static PoolStats pools = {{0}, {0}, {0}}; return pools;}
+	//prints the summary of the counters: a line per executed command, the walks, the nodes, the allocations
+	void PrintStats(ostream &os = cout) const {
+		static const char *names[] = {"", "MD", "CD", "RD", "DELTREE", "MF", "MHL", "MDL", "DEL", "COPY", "MOVE"};
+		char line[160];
+		os << "command     count   failed   total ms    mean us  p50 us <=  p99 us <=\n";
+		for(int op = opMD; op <= opMove; ++op) {
+			const Stats::Command &c = stats_.commands[op];
+			if(!c.count) continue;
+			std::snprintf(line, sizeof(line), "%-8s %8llu %8llu %10.2f %10.3f %10.3f %10.3f\n", names[op], 
+			              (unsigned long long)c.count, (unsigned long long)c.failed, c.time / 1e6, c.time / 1e3 / c.count,
+			              Stats::GetPercentile(c, 50) / 1e3, Stats::GetPercentile(c, 99) / 1e3);
+			os << line;
+		}
+		const PoolStats &pools = GetPoolStats();
+		os << "walks: " << stats_.walks << ", directories passed: " << stats_.steps << ", deepest: " << stats_.maxDepth << "\n"
+		   << "nodes copied: " << stats_.copied << ", subtrees shared: " << stats_.shared << ", unshared: " << stats_.unshared << "\n"
+		   << "nodes removed: " << stats_.removed << ", visited by the removals: " << stats_.visited << "\n"
+		   << "links made: " << stats_.links << ", removed: " << stats_.unlinks << "\n"
+		   << "pool blocks allocated: " << pools.allocated << ", freed: " << pools.freed << ", bytes reserved: " << pools.reserved << "\n";
+	}
+	//exports the counters as JSON, the histograms list their non-empty buckets by the lower bounds (ns)
+	void WriteStatsJson(ostream &os) const {
+		static const char *names[] = {"", "md", "cd", "rd", "deltree", "mf", "mhl", "mdl", "del", "copy", "move"};
+		os << "{\n  \"commands\": {";
+		const char *sep = "\n";
+		for(int op = opMD; op <= opMove; ++op) {
+			const Stats::Command &c = stats_.commands[op];
+			if(!c.count) continue;
+			os << sep << "    \"" << names[op] << "\": {\"count\": " << c.count << ", \"failed\": " << c.failed 
+			   << ", \"time_ns\": " << c.time << ", \"histogram_ns\": {";
+			const char *bsep = "";
+			for(size_t k = 0; k < 40; ++k)
+				if(c.buckets[k]) {os << bsep << "\"" << (std::uint64_t(1) << k) << "\": " << c.buckets[k]; bsep = ", ";}
+			os << "}}";
+			sep = ",\n";
+		}
+		const PoolStats &pools = GetPoolStats();
+		os << "\n  },\n"
+		   << "  \"walks\": {\"count\": " << stats_.walks << ", \"steps\": " << stats_.steps << ", \"max_depth\": " << stats_.maxDepth << "},\n"
+		   << "  \"nodes\": {\"copied\": " << stats_.copied << ", \"shared\": " << stats_.shared << ", \"unshared\": " << stats_.unshared 
+		   << ", \"removed\": " << stats_.removed << ", \"visited\": " << stats_.visited << "},\n"
+		   << "  \"links\": {\"made\": " << stats_.links << ", \"removed\": " << stats_.unlinks << "},\n"
+		   << "  \"pools\": {\"allocated\": " << pools.allocated << ", \"freed\": " << pools.freed << ", \"reserved\": " << pools.reserved << "}\n"
+		   << "}\n";
 	}
 
 	//creates a directory
-	void MakeDirectory(const string &dname) {
-		string parentdir, name, path__ = MakeAbsPath(dname);
-		SplitPath(path__, parentdir, name);
-		File *dir = Path2File(parentdir);
+	Status MakeDirectory(string_view dname) {
+		string_view name;
+		File *dir = ResolveParent(dname, name, true);
 		if(!dir) 
-			ErrorMsg("MD failed! " + dname + " has not a valid path, the program will terminate.");
+			return Fail(stBadPath, "MD failed! " + string(dname) + " has not a valid path");
 		if(!IsValidFileName(name)) 
-			ErrorMsg("MD failed! " + dname + " is not a valid name, the program will terminate.");
+			return Fail(stBadName, "MD failed! " + string(dname) + " is not a valid name");
 		if(!dir->HasDir(name) && !dir->HasFile(name)) 
-			dir->subdirs_.insert(new File(name, File::directory, dir));
+			Attach(dir, Take(new File(string(name), File::directory, dir)));
+		return stOk;
 	}
 	//changes the current directory
-	void ChangeCurDirectory(const string &dname) {
-		string parentdir, name, path__ = MakeAbsPath(dname);
+	Status ChangeCurDirectory(string_view dname) {
+		string_view parentdir, name;
+		string path__ = MakeAbsPath(dname);
 		SplitPath(path__, parentdir, name);
 		File *dir = parentdir.length() ? Path2File(parentdir) : &root_;
 		if(!dir) 
-			ErrorMsg("CD failed! " + dname + " has not a valid path, the program will terminate.");
+			return Fail(stBadPath, "CD failed! " + string(dname) + " has not a valid path");
 		if(!IsValidFileName(name)) 
-			ErrorMsg("CD failed! " + dname + " is not a valid name, the program will terminate.");
+			return Fail(stBadName, "CD failed! " + string(dname) + " is not a valid name");
+		Record(UndoRecord::chdir, 0, 0, 0, curdir_);
 		curdir_ = path__;
+		ResetCurDir();
+		return stOk;
 	}
 	//removes a directory if it is empty (doesnt contain any files or subdirectories)
-	void RemoveDirectory(const string &dname) {
-		string parentdir, name, path__ = MakeAbsPath(dname);
-		if(path__ == curdir_)
-			ErrorMsg(string("RD failed! ") + "The current directory (" + curdir_ + ") cannot be deleted, the program will terminate.");
-		File *dir = Path2File(path__);
+	Status RemoveDirectory(string_view dname) {
+		string_view name;
+		if(MakeAbsPath(dname) == curdir_)
+			return Fail(stCurrentDir, "RD failed! The current directory (" + curdir_ + ") cannot be deleted");
+		File *pardir = ResolveParent(dname, name, true), *dir = pardir ? pardir->HasDir(name) : 0;
 		if(!dir) 
-			ErrorMsg("RD failed! " + dname + " has not valid path, the program will terminate.");
+			return Fail(stBadPath, "RD failed! " + string(dname) + " has not valid path");
 		if(dir->HasHardLinks()) 
-			ErrorMsg("RD failed! The directory " + name + " has hard link(s), the program will terminate.");
-		if(dir->IsEmptyDir()) {
-			SplitPath(path__, parentdir, name);
-			dir->DelDynLinks();
-			Path2File(parentdir)->subdirs_.erase(dir);
-			delete dir;
-		}
+			return Fail(stHardLinks, "RD failed! The directory " + string(name) + " has hard link(s)");
+		if(dir->IsEmptyDir()) RemoveNode(pardir, dir);
+		return stOk;
 	}
 	//removes a directory with all its subdirectories
-	void DeleteTree(const string &path) {
-		string parentdir, name, path__ = MakeAbsPath(path);
-		SplitPath(path__, parentdir, name);
-		File *pardir = Path2File(parentdir), *dir;
-		if(!pardir) ErrorMsg("DELTREE failed! " + path + " is not valid, the program will terminate.");
+	Status DeleteTree(string_view path) {
+		string_view name;
+		File *pardir = ResolveParent(path, name, true), *dir;
+		if(!pardir) return Fail(stBadPath, "DELTREE failed! " + string(path) + " is not valid");
 		dir = pardir->HasDir(name);
-		if(!dir) ErrorMsg("DELTREE failed! " + path + " is not valid, the program will terminate.");
+		if(!dir) return Fail(stBadPath, "DELTREE failed! " + string(path) + " is not valid");
 
 		//cant remove a directory which contains the current directory as one of its subdirectories.
-		vector<string> dirs1, dirs2;
-		TokenizeString(path__, dirs1);
-		TokenizeString(curdir_, dirs2);
-		if(dirs1.size() <= dirs2.size()) {
-			bool contains = true;
-			for(size_t i = 0, n = dirs1.size(); i < n; ++i)
-				if(dirs1[i] != dirs2[i]) {contains = false; break;} 
-			if(contains)
-				ErrorMsg("DELTREE failed! " + path + " cannot be deleted since it contains the current directory, the program will terminate");
-		}
-		DelDir(dir, false);
+		if(IsPathPrefix(MakeAbsPath(path), curdir_))
+			return Fail(stCurrentDir, "DELTREE failed! " + string(path) + " cannot be deleted since it contains the current directory");
+		return DelDir(pardir, dir);
 	}
 	//creates a file
-	void MakeFile(const string &fname) {
-		string parentdir, name, path__ = MakeAbsPath(fname);
-		SplitPath(path__, parentdir, name);
-		File *dir = Path2File(parentdir);
+	Status MakeFile(string_view fname) {
+		string_view name;
+		File *dir = ResolveParent(fname, name, true);
 		if(!dir) 
-			ErrorMsg("MF failed! " + path__ + " is not a valid path, the program will terminate.");
+			return Fail(stBadPath, "MF failed! " + MakeAbsPath(fname) + " is not a valid path");
 		if(!IsValidFileName(name)) 
-			ErrorMsg("MF failed! " + fname + " is not a valid name, the program will terminate.");
+			return Fail(stBadName, "MF failed! " + string(fname) + " is not a valid name");
 		if(!dir->HasFile(name) && !dir->HasDir(name)) 
-			dir->files_.insert(new File(name, File::file, dir));
+			Attach(dir, Take(new File(string(name), File::file, dir)));
+		return stOk;
 	}
 	//creates a hard link to a file/directory and places it in given location
-	void MakeHardLink(const string &srcpath, const string &dstpath) {
-		File *dst = Path2File(MakeAbsPath(dstpath)), *src, *sdir, *sfile, *lnk;
-		if(!dst) ErrorMsg("MHL failed! " + dstpath + " is not a valid path, the program will terminate.");
-		string parentdir, name, path__ = MakeAbsPath(srcpath);
+	Status MakeHardLink(string_view srcpath, string_view dstpath) {
+		File *dst = Path2File(dstpath, true), *src, *sdir, *sfile;
+		if(!dst) return Fail(stBadPath, "MHL failed! " + string(dstpath) + " is not a valid path");
+		string_view parentdir, name;
+		string path__ = MakeAbsPath(srcpath);
 
 		SplitPath(path__, parentdir, name);
-		src = Path2File(parentdir);
-		if(!src) ErrorMsg("MHL failed! " + parentdir + " is not a valid path, the program will terminate.");
+		src = Path2File(parentdir, true);
+		if(!src) return Fail(stBadPath, "MHL failed! " + string(parentdir) + " is not a valid path");
 		sdir = src->HasDir(name);
-		sfile = src->HasFile(name);
+		sfile = FindFile(src, name);
 		if(!sdir && !sfile)
-			ErrorMsg("MHL failed! " + path__ + " is not a file or directory, the program will terminate.");
-		if(dst->HasFile((name = "hlink[" + path__ + "]"))) return;
-		lnk = new File(name, File::hardlink, dst);
-		if(sdir) sdir->hlinks_[lnk] = dst;
-		if(sfile) sfile->hlinks_[lnk] = dst;
-		dst->files_.insert(lnk);
+			return Fail(stNotFound, "MHL failed! " + path__ + " is not a file or directory");
+		File *target = sdir ? Unshare(src, sdir) : Unshare(src, sfile);
+		//a hard link to a dynamic link is made to its target
+		if(target->IsDynLink()) target = target->target_;
+		if(FindLink(dst, target, File::hardlink)) return stOk;
+		Attach(dst, Take(MakeLink("hlink[" + target->GetPath() + "]", File::hardlink, dst, target)));
+		return stOk;
 	}
 	//creates a dynamic link to a file/directory and places it in given location
-	void MakeDynamicLink(const string &srcpath, const string &dstpath) {
-		File *dst = Path2File(MakeAbsPath(dstpath)), *src, *sdir, *sfile, *lnk;
-		if(!dst) ErrorMsg("MDL failed! " + dstpath + " is not a valid path, the program will terminate.");
-		string parentdir, name, path__ = MakeAbsPath(srcpath);
+	Status MakeDynamicLink(string_view srcpath, string_view dstpath) {
+		File *dst = Path2File(dstpath, true), *src, *sdir, *sfile;
+		if(!dst) return Fail(stBadPath, "MDL failed! " + string(dstpath) + " is not a valid path");
+		string_view parentdir, name;
+		string path__ = MakeAbsPath(srcpath);
 
 		SplitPath(path__, parentdir, name);
-		src = Path2File(parentdir);
-		if(!src) ErrorMsg("MDL failed! " + parentdir + " is not a valid path, the program will terminate.");
+		src = Path2File(parentdir, true);
+		if(!src) return Fail(stBadPath, "MDL failed! " + string(parentdir) + " is not a valid path");
 		sdir = src->HasDir(name);
-		sfile = src->HasFile(name);
+		sfile = FindFile(src, name);
 		if(!sdir && !sfile)
-			ErrorMsg("MDL failed! " + path__ + " is not a file or directory, the program will terminate.");
-		if(dst->HasFile((name = "dlink[" + path__ + "]"))) return;
-		lnk = new File(name, File::dynlink, dst);
-		if(sdir) sdir->dlinks_[lnk] = dst;
-		if(sfile) sfile->dlinks_[lnk] = dst;
-		dst->files_.insert(lnk);
+			return Fail(stNotFound, "MDL failed! " + path__ + " is not a file or directory");
+		File *target = sdir ? Unshare(src, sdir) : Unshare(src, sfile);
+		if(FindLink(dst, target)) return stOk;
+		Attach(dst, Take(MakeLink("dlink[" + target->GetPath() + "]", File::dynlink, dst, target)));
+		return stOk;
 	}
 	//removes a file or link
-	void DeleteFile(const string &fname) {
-		File *dir, *file;
-		string parentdir, name, path__ = MakeAbsPath(fname);
-		
-		SplitPath(path__, parentdir, name);
-		dir = Path2File(parentdir);
-		if(!dir) ErrorMsg("DEL failed! " + parentdir + " is not a valid path, the program will terminate.");
-		file = dir->HasFile(name);
-		if(!file) ErrorMsg("DEL failed! There is no " + name + " file, the program will terminate.");
+	Status DeleteFile(string_view fname) {
+		string_view name;
+		File *dir = ResolveParent(fname, name, true), *file;
+		if(!dir) return Fail(stBadPath, "DEL failed! " + string(fname) + " is not a valid path");
+		file = FindFile(dir, name);
+		if(!file) return Fail(stNotFound, "DEL failed! There is no " + string(name) + " file");
 		if(file->HasHardLinks()) 
-			ErrorMsg("DEL failed! The file " + name + " has hard link(s), the program will terminate.");
-		file->DelDynLinks();
-		dir->files_.erase(file);
-		delete file;
-	}
-	//copies an existed directory/file/link to another location
-	void CopyFile(const string &srcpath, const string &dstpath) {
-		if(srcpath == dstpath || srcpath.length() < 3) return;
-		File *dstpdir, *dstdir, *srcpdir, *srcdir;
-		bool notrootdir;
-		string parentdir, name, path__ = MakeAbsPath(dstpath);
-		SplitPath(path__, parentdir, name);
-		dstpdir = Path2File((notrootdir = parentdir.length() > 0) ? parentdir : name);
-		if(!dstpdir) ErrorMsg("COPY failed! " + parentdir + " is not a valid path, the program will terminate.");
-		dstdir = dstpdir->HasDir(name);
-		if(!dstdir && notrootdir) ErrorMsg("COPY failed! There is no " + name + " directory, the program will terminate.");
-		if(!notrootdir) dstdir = dstpdir;
+			return Fail(stHardLinks, "DEL failed! The file " + string(name) + " has hard link(s)");
+		RemoveNode(dir, file);
+		return stOk;
+	}
+	//copies an existed directory/file/link to another location,
+	//the copy shares the source's nodes until one of them gets modified
+	Status CopyFile(string_view srcpath, string_view dstpath) {
+		if(srcpath == dstpath || srcpath.length() < 3) return stOk;
+		File *dstpdir, *dstdir, *srcpdir, *srcdir, *copy;
+		string_view name;
+		if(IsRootPath(dstpath)) dstdir = &root_;
+		else {
+			dstpdir = ResolveParent(dstpath, name, true);
+			if(!dstpdir) return Fail(stBadPath, "COPY failed! " + string(dstpath) + " is not a valid path");
+			dstdir = dstpdir->HasDir(name);
+			if(!dstdir) return Fail(stNotFound, "COPY failed! There is no " + string(name) + " directory");
+			dstdir = Unshare(dstpdir, dstdir);
+		}
 
-		path__ = MakeAbsPath(srcpath);
-		SplitPath(path__, parentdir, name);
-		srcpdir = Path2File(parentdir);
-		if(!srcpdir) ErrorMsg("DEL failed! " + parentdir + " is not a valid path, the program will terminate.");
+		srcpdir = ResolveParent(srcpath, name);
+		if(!srcpdir) return Fail(stBadPath, "COPY failed! " + string(srcpath) + " is not a valid path");
 		srcdir = srcpdir->HasDir(name);
-		if(!srcdir) srcdir = srcpdir->HasFile(name);
-		if(!srcdir) ErrorMsg("DEL failed! There is no " + name + " file or directory, the program will terminate.");
+		if(!srcdir) srcdir = FindFile(srcpdir, name);
+		if(!srcdir) return Fail(stNotFound, "COPY failed! There is no " + string(name) + " file or directory");
 
-		if(srcdir->IsDirectory()) dstdir->subdirs_.insert(CopyTree(srcdir, dstdir)); 
-		else dstdir->files_.insert(new File(srcdir->name_, srcdir->type_, srcdir->parent_));
+		if(srcdir->IsDirectory()) {
+			if(dstdir->HasDir(srcdir->name_)) return stOk;
+			//a directory copied into its own subtree cannot be shared, it would contain itself
+			copy = CopyTree(srcdir, dstdir, !IsPathPrefix(MakeAbsPath(srcpath), MakeAbsPath(dstpath)));
+		}
+		else {
+			if(dstdir->HasFile(srcdir->name_)) return stOk;
+			if(srcdir->haslinks_) copy = CopyNode(srcdir, dstdir);
+			else {copy = srcdir; ++copy->refs_; FM_STAT(++CurrentStats().shared);}
+		}
+		Attach(dstdir, Take(copy));
+		if(copy->haslinks_) MarkLinks(dstdir);
+		ResetCurDir();
+		return stOk;
 	}
-	//moves an existing directory/file/link to another location
-	void MoveFile(const string &srcpath, const string &dstpath) {
-		CopyFile(srcpath, dstpath);
-		string parentdir, name, path__ = MakeAbsPath(srcpath);
-		SplitPath(path__, parentdir, name);
-		File *dir = Path2File(parentdir);
-		if(!dir) ErrorMsg("MOVE failed! " + parentdir + " is invalid path, the program will terminate.");
-		if(dir->HasDir(name)) DeleteTree(srcpath);
-		else if(dir->HasFile(name)) DeleteFile(srcpath);
-		else ErrorMsg("MOVE failed! " + srcpath + " doesn't exist, the program will terminate");
-		UpdateDynLinks(MakeAbsPath(dstpath) + "\\" + name);
+	//moves an existing directory/file/link to another location, the node is re-parented
+	Status MoveFile(string_view srcpath, string_view dstpath) {
+		File *dstdir = Path2File(dstpath, true), *dir, *file;
+		if(!dstdir) return Fail(stBadPath, "MOVE failed! " + string(dstpath) + " is not a valid path");
+		string_view name;
+		dir = ResolveParent(srcpath, name, true);
+		if(!dir) return Fail(stBadPath, "MOVE failed! " + string(srcpath) + " is invalid path");
+		file = dir->HasDir(name);
+		if(!file) file = FindFile(dir, name);
+		if(!file) return Fail(stNotFound, "MOVE failed! " + string(srcpath) + " doesn't exist");
+		if(file->IsDirectory()) {
+			string path__ = MakeAbsPath(srcpath);
+			if(IsPathPrefix(path__, curdir_))
+				return Fail(stCurrentDir, "MOVE failed! " + string(srcpath) + " cannot be moved since it contains the current directory");
+			if(IsPathPrefix(path__, MakeAbsPath(dstpath)))
+				return Fail(stIntoItself, "MOVE failed! " + string(srcpath) + " cannot be moved into itself");
+		}
+		if(dstdir == dir) return stOk;
+
+		//the destination has such an entry already, the source is dropped (as the copy and delete did)
+		if(Entries(dstdir, file).count(file)) return file->IsDirectory() ? DelDir(dir, file) : DeleteFile(srcpath);
+		Detach(dir, file);
+		Attach(dstdir, file);
+		Record(UndoRecord::reparent, file->parent_, file);
+		file->parent_ = dstdir;
+		//the links refer to the node, they follow it, the links to the moved nodes get their new paths
+		if(file->haslinks_) {
+			MarkLinks(dstdir);
+			UnmarkLinks(dir);
+			vector<File *> nodes;
+			CollectLinked(file, nodes);
+			for(size_t i = 0; i < nodes.size(); ++i)
+				if(nodes[i]->HasHardLinks() || nodes[i]->HasDynLinks()) RenameLinks(nodes[i]);
+		}
+		return stOk;
+	}
+
+	//no limit of the printed tree's depth
+	static const size_t AnyDepth = size_t(-1);
+	//prints the directory structure (down to the depth, the root is at the depth 0)
+	inline void Print(ostream &os = cout, size_t depth = AnyDepth) const {root_.Print(os, depth);}
+	//prints the structure of the directory given by the path (a file is printed alone)
+	Status PrintSubtree(string_view path, ostream &os = cout, size_t depth = AnyDepth) {
+		File *node = &root_;
+		if(!IsRootPath(path)) {
+			string_view name;
+			File *dir = ResolveParent(path, name);
+			node = dir ? dir->HasDir(name) : 0;
+			if(dir && !node) node = FindFile(dir, name);
+		}
+		if(!node) return Fail(stBadPath, "PRINT failed! " + string(path) + " is not a valid path");
+		node->Print(os, depth);
+		return stOk;
+	}
+	//prints the structure of the directory given by the path (the whole tree if it is empty) into the file
+	Status PrintToFile(const string &outFile, string_view path = string_view(), size_t depth = AnyDepth) {
+		ofstream ofs(outFile.c_str(), std::ios::binary);
+		if(!ofs) return Fail(stCannotWrite, "Cannot write to " + outFile + " file");
+		if(path.empty()) Print(ofs, depth);
+		else if(PrintSubtree(path, ofs, depth) != stOk) return stBadPath;
+		ofs.close();
+		if(!ofs) return Fail(stCannotWrite, "Cannot write to " + outFile + " file");
+		return stOk;
+	}
+	//counts of the nodes below a directory by their types
+	struct Usage {
+		std::uint64_t files, directories, hardlinks, dynlinks;
+	};
+	//finds the files, directories and links below the directory (in the whole tree if the path is empty) whose names 
+	//match the pattern (* - any characters, ? - any character), the paths are sorted; the queries are answered by 
+	//the index of the names built by the first one and kept up to date by the commands since then
+	Status Find(string_view pattern, vector<string> &paths, string_view path = string_view()) {
+		File *dir = QueryDir(path);
+		if(!dir) return Fail(stBadPath, "FIND failed! " + string(path) + " is not a valid path");
+		paths.clear();
+		GetIndex().Find(pattern, dir, path.empty() ? root_.name_ : MakeAbsPath(path), paths);
+		std::sort(paths.begin(), paths.end());
+		return stOk;
+	}
+	//gets the counts of the nodes below the directory (the whole tree if the path is empty) as du does, 
+	//a copied subtree is counted at each of its places (even though it is shared)
+	Status GetUsage(string_view path, Usage &usage) {
+		File *dir = QueryDir(path);
+		if(!dir) return Fail(stBadPath, "USAGE failed! " + string(path) + " is not a valid path");
+		usage = GetIndex().GetCounts(dir);
+		return stOk;
+	}
+	//saves the tree (the nodes, their types and links, the current directory) into a binary snapshot file,
+	//a shared node is stored once; the journal is truncated since the snapshot covers its commands
+	Status SaveSnapshot(const string &filePath) {
+		if(!marks_.empty()) return Fail(stInTransaction, "Cannot save the snapshot within a transaction");
+		vector<SnapshotNode> nodes;
+		vector<std::uint32_t> children;
+		string names;
+		CollectNodes(nodes, children, names);
+
+		ofstream ofs(filePath.c_str(), std::ios::binary);
+		if(!ofs) return Fail(stCannotWrite, "Cannot write to " + filePath + " file");
+		SnapshotHeader h;
+		std::memset(&h, 0, sizeof(h));
+		std::memcpy(h.magic, "FMSNAP", 6);
+		h.version = SnapshotVersion;
+		h.byteOrder = SnapshotByteOrder;
+		h.nodes = nodes.size();
+		h.children = children.size();
+		h.names = names.size();
+		h.curdir = curdir_.size();
+		ofs.write(reinterpret_cast<const char *>(&h), sizeof(h));
+
+		SnapshotWriter w(ofs);
+		w.Put(nodes);
+		w.Put(children);
+		w.Put(names.data(), names.size());
+		w.Put(curdir_.data(), curdir_.size());
+		h.checksum = w.GetChecksum();
+		ofs.seekp(0);
+		ofs.write(reinterpret_cast<const char *>(&h), sizeof(h));
+		ofs.close();
+		if(!ofs) return Fail(stCannotWrite, "Cannot write to " + filePath + " file");
+		if(journal_.is_open()) {
+			journal_.close();
+			journal_.open(journalPath_.c_str(), std::ios::binary | std::ios::trunc);
+		}
+		return stOk;
+	}
+	//replaces the tree with the one of the snapshot file, the file is read at once and checked before 
+	//the tree is replaced (the tree is kept if the file is not a valid snapshot of this version)
+	Status LoadSnapshot(const string &filePath) {
+		if(!marks_.empty()) return Fail(stInTransaction, "Cannot load the snapshot within a transaction");
+		vector<char> buf;
+		if(!ReadSnapshotFile(filePath, buf)) return Fail(stCannotRead, "Cannot read from " + filePath + " file");
+
+		SnapshotHeader h;
+		vector<SnapshotNode> nodes;
+		vector<std::uint32_t> children;
+		string_view names, curdir;
+		bool valid = ReadSnapshotHeader(buf, "FMSNAP", SnapshotVersion, h);
+		if(valid) {
+			SnapshotReader r(buf.data() + sizeof(h), buf.data() + buf.size());
+			valid = r.Get(nodes, h.nodes) && r.Get(children, h.children) && r.Get(names, h.names) && r.Get(curdir, h.curdir) &&
+			        IsValidSnapshot(nodes, children, names) && IsAbsPath(curdir);
+		}
+		if(!valid) return Fail(stBadSnapshot, filePath + " is not a valid snapshot");
+
+		//the children precede their directories, the root is the last node
+		root_.Clear(0);
+		index_.Reset();
+		dlinks_.clear();
+		hlinks_.clear();
+		vector<File *> files(nodes.size());
+		for(size_t i = 0, n = nodes.size(); i < n; ++i) {
+			const SnapshotNode &sn = nodes[i];
+			File *node = i + 1 == n ? &root_ : new File(string(names.substr(sn.name, sn.length)), File::Type(sn.type));
+			if(node != &root_) node->refs_ = 0;
+			node->haslinks_ = sn.haslinks != 0;
+			for(std::uint32_t k = 0; k < sn.files + sn.subdirs; ++k) {
+				File *child = files[children[sn.children + k]];
+				File::FileSet &set = k < sn.files ? node->files_ : node->subdirs_;
+				set.insert(set.end(), child);
+				child->parent_ = node;
+				++child->refs_;
+			}
+			files[i] = node;
+		}
+		for(size_t i = 0, n = nodes.size(); i < n; ++i)
+			if(nodes[i].target != NoNode) {
+				files[i]->target_ = files[nodes[i].target];
+				RegisterLink(files[i]);
+			}
+		curdir_ = string(curdir);
+		curnode_ = 0;
+		return stOk;
+	}
+	//replays the commands of the journal file (if it exists) and appends the commands executed from the batches 
+	//to it (the ones of the transactions when they are committed), the tree is restored by the last snapshot
+	//and the journal of the commands executed after it
+	Status OpenJournal(const string &filePath) {
+		if(!marks_.empty()) return Fail(stInTransaction, "Cannot open the journal within a transaction");
+		journal_.close();
+		if(ifstream(filePath.c_str()).good()) {
+			Status st = ExecBatchFile(filePath);
+			if(st != stOk) return st;
+		}
+		journal_.clear();
+		journal_.open(filePath.c_str(), std::ios::binary | std::ios::app);
+		if(!journal_) return Fail(stCannotWrite, "Cannot write to " + filePath + " file");
+		journalPath_ = filePath;
+		return stOk;
 	}
 
-	//prints the directory structure
-	inline void Print() const {root_.Print();}
 	//shows an error message (and quits)
 	static void ErrorMsg(const string &msg, bool stop = true) {cout << msg << endl; if(stop) {system("pause"); exit(1);}}
 
 protected:
+	//pool of fixed size blocks: blocks are cut from large chunks and the freed ones
+	//are kept in a free list for reuse, chunks are released when the pool is destroyed
+	template<size_t Size, size_t Align>
+	class BlockPool {
+	public:
+		static BlockPool &Instance() {static BlockPool pool; return pool;}
+		void *Allocate() {
+			std::lock_guard<std::mutex> guard(lock_);
+			if(!free_) Grow();
+			Block *b = free_;
+			free_ = b->next;
+			FM_STAT(GetPoolStats().allocated.fetch_add(1, std::memory_order_relaxed));
+			return b;
+		}
+		void Free(void *p) {
+			std::lock_guard<std::mutex> guard(lock_);
+			Block *b = static_cast<Block *>(p);
+			b->next = free_;
+			free_ = b;
+			FM_STAT(GetPoolStats().freed.fetch_add(1, std::memory_order_relaxed));
+		}
+		~BlockPool() {for(size_t i = 0, n = chunks_.size(); i < n; ++i) ::operator delete(chunks_[i]);}
+	private:
+		union Block {
+			Block *next;
+			alignas(Align) unsigned char data[Size];
+		};
+		Block *free_;
+		vector<Block *> chunks_;
+		//the nodes are allocated and freed by the threads executing the commands
+		std::mutex lock_;
+
+		BlockPool() : free_(0) {}
+		//allocates the next chunk, each one is twice bigger than the previous (up to 64K blocks)
+		void Grow() {
+			size_t n = size_t(64) << (chunks_.size() < 10 ? chunks_.size() : 10);
+			Block *chunk = static_cast<Block *>(::operator new(n * sizeof(Block)));
+			chunks_.push_back(chunk);
+			for(size_t i = 0; i < n; ++i) {chunk[i].next = free_; free_ = chunk + i;}
+			FM_STAT(GetPoolStats().reserved.fetch_add(n * sizeof(Block), std::memory_order_relaxed));
+		}
+	};
+	//allocator of the sets' and maps' nodes from the pool of their size
+	template<class T>
+	struct PoolAllocator {
+		typedef T value_type;
+		PoolAllocator() {}
+		template<class U> PoolAllocator(const PoolAllocator<U> &) {}
+		T* allocate(size_t n) {
+			if(n != 1) return static_cast<T *>(::operator new(n * sizeof(T)));
+			return static_cast<T *>(BlockPool<sizeof(T), alignof(T)>::Instance().Allocate());
+		}
+		void deallocate(T *p, size_t n) {
+			if(n != 1) ::operator delete(p);
+			else BlockPool<sizeof(T), alignof(T)>::Instance().Free(p);
+		}
+		template<class U> bool operator==(const PoolAllocator<U> &) const {return true;}
+		template<class U> bool operator!=(const PoolAllocator<U> &) const {return false;}
+	};
 	struct File;
+	class NodeIndex;
+	//orders files by name, names can be looked up directly (without constructing a File)
 	struct FileCmp {
-		bool operator()(const File *lhs,  const File *rhs) const {
-			return strcmp(lhs->name_.c_str(), rhs->name_.c_str()) < 0;
-		}
+		typedef void is_transparent;
+		bool operator()(const File *lhs,  const File *rhs) const {return lhs->name_ < rhs->name_;}
+		bool operator()(const File *lhs, string_view rhs) const {return string_view(lhs->name_) < rhs;}
+		bool operator()(string_view lhs, const File *rhs) const {return lhs < string_view(rhs->name_);}
 	};
 	struct File {
 		enum Type {file, directory, hardlink, dynlink};
-		typedef set<File *, FileCmp> FileSet;
-		typedef map<File *, File *, FileCmp> LinkMap;
+		typedef set<File *, FileCmp, PoolAllocator<File *> > FileSet;
 		FileSet files_, subdirs_;
-		//key of LinkMap holds the link, value - parent directory
-		LinkMap hlinks_, dlinks_;
+		//the name of a link is the current path of its target, the link is renamed when
+		//the target (or a directory above it) moves, so the entries are ordered by the shown names
 		string name_;
 		Type type_;
+		//the parent is kept for the nodes which are not shared only
 		File *parent_;
+		//count of the directories holding the node, the copies share the nodes
+		//(the shared nodes may be released by several threads)
+		std::atomic<unsigned> refs_;
+		//the subtree has links or link targets, such nodes are never shared (the mark is cleared
+		//when the last of them is removed or moved out)
+		bool haslinks_;
+		//target of the link
+		File *target_;
+		//counts of the links to this file/directory
+		unsigned hardlinks_, dynlinks_;
 		
 		//construct a file
-		File(const string &name, Type t = file, File *p = 0) : name_(name), type_(t), parent_(p) {}
-
-		//deletes all its files if the object is directory
-		void DeleteFiles(bool ignore_hard_links = true) {
-			FileSet::const_iterator start = files_.begin(), end = files_.end(), i;
-			for(i = start; i != end; ++i) 
-				if(!ignore_hard_links && (*i)->HasHardLinks())
-					ErrorMsg("Cannot delete " + (*i)->name_ + " file, it has hard link(s), the program will terminate.");
-				else delete *i;
+		File(const string &name, Type t = file, File *p = 0) : 
+			name_(name), type_(t), parent_(p), refs_(1), haslinks_(false), target_(0), hardlinks_(0), dynlinks_(0) {}
+
+		//the nodes are allocated from the pool, the names of the files and directories (8.3 at most) fit
+		//in the string's own buffer, the names of the links hold paths and are allocated on the heap
+		static void* operator new(size_t) {return BlockPool<sizeof(File), alignof(File)>::Instance().Allocate();}
+		static void operator delete(void *p) {BlockPool<sizeof(File), alignof(File)>::Instance().Free(p);}
+
+		//drops a reference to the node, the last one deletes the node with its subtree (and removes them from the index)
+		void Release(NodeIndex *index) {
+			if(--refs_) return;
+			Clear(index);
+			if(index) index->Forget(this);
+			delete this;
+		}
+		//releases all its files and subdirectories
+		void Clear(NodeIndex *index) {
+			FileSet::const_iterator i, last;
+			for(i = files_.begin(), last = files_.end(); i != last; ++i) {if(index) index->Detach(this, *i); (*i)->Release(index);}
+			for(i = subdirs_.begin(), last = subdirs_.end(); i != last; ++i) {if(index) index->Detach(this, *i); (*i)->Release(index);}
 			files_.clear();
+			subdirs_.clear();
 		}
-		//deletes all dynamic links which might have this file/dir/link
-		void DelDynLinks() {
-			for(LinkMap::iterator i = dlinks_.begin(), last = dlinks_.end(); i != last; ++i) {
-				i->second->files_.erase(i->first);
-				delete i->first;
-			}
-			dlinks_.clear();
+		//builds the absolute path, the parents are valid for the link targets
+		string GetPath() const {
+			string path = GetDisplayName();
+			for(const File *p = parent_; p; p = p->parent_) path = p->name_ + "\\" + path;
+			return path;
 		}
-		//prints directory structure
-		void Print(string padding = "") const {
-			cout << name_ << endl;
-			padding += "  ";
-			FileSet::const_iterator i, last;
-			for(i = files_.begin(), last = files_.end(); i!=last; ++i)
-				cout << padding << (*i)->name_ << endl;
-			for(i = subdirs_.begin(), last = subdirs_.end(); i!=last; ++i) {
-				cout << padding; 
-				(*i)->Print(padding);
+		//gets the name to show, a dynamic link is named after the current path of its target
+		string GetDisplayName() const {return IsDynLink() ? "dlink[" + target_->GetPath() + "]" : name_;}
+		//prints directory structure down to the depth, the tree is walked with an explicit stack
+		//of the directories being printed and the lines are written to the stream by large blocks
+		void Print(ostream &os, size_t depth) const {
+			static const size_t BlockSize = 1 << 16;
+			vector<std::pair<const File *, FileSet::const_iterator> > stack;
+			string out;
+			out.reserve(BlockSize + 512);
+			for(const File *dir = this; ; ) {
+				//the directory's line, then its files, the subdirectories follow from the stack
+				size_t level = stack.size();
+				out.append(2 * level, ' ').append(dir->GetDisplayName()).push_back('\n');
+				if(level < depth) {
+					for(FileSet::const_iterator i = dir->files_.begin(), last = dir->files_.end(); i != last; ++i) {
+						out.append(2 * level + 2, ' ').append((*i)->GetDisplayName()).push_back('\n');
+						if(out.size() >= BlockSize) {os.write(out.data(), out.size()); out.clear();}
+					}
+					stack.push_back(std::make_pair(dir, dir->subdirs_.begin()));
+				}
+				if(out.size() >= BlockSize) {os.write(out.data(), out.size()); out.clear();}
+				while(!stack.empty() && stack.back().second == stack.back().first->subdirs_.end()) stack.pop_back();
+				if(stack.empty()) break;
+				dir = *stack.back().second++;
 			}
+			os.write(out.data(), out.size());
+			os.flush();
 		}
 		//checks if this directory has files
-		File* HasFile(const string &fname) {
-			FileSet::const_iterator start = files_.begin(), end = files_.end(), i;
-			for(i = start; i != end; ++i) if((*i)->name_ == fname) return *i;
-			return 0;
+		File* HasFile(string_view fname) const {
+			FileSet::const_iterator i = files_.find(fname);
+			return i == files_.end() ? 0 : *i;
 		}
 		//checks if this directory has subdirectories
-		File* HasDir(const string &dname) {
-			FileSet::const_iterator start = subdirs_.begin(), end = subdirs_.end(), i;
-			for(i = start; i != end; ++i) if((*i)->name_ == dname) return *i;
-			return 0;
+		File* HasDir(string_view dname) const {
+			FileSet::const_iterator i = subdirs_.find(dname);
+			return i == subdirs_.end() ? 0 : *i;
 		}
-		inline bool HasDynLinks() const {return !dlinks_.empty();}
-		inline bool HasHardLinks() const {return !hlinks_.empty();}
+		inline bool HasDynLinks() const {return dynlinks_ != 0;}
+		inline bool HasHardLinks() const {return hardlinks_ != 0;}
 		inline bool IsFile() const {return type_ == file;}
 		inline bool IsDirectory() const {return type_ == directory;}
 		inline bool IsHardLink() const {return type_ == hardlink;}
 		inline bool IsDynLink() const {return type_ == dynlink;}
-		inline bool IsEmptyDir() const {return IsDirectory() && files_.empty() && subdirs_.empty() && hlinks_.empty() && dlinks_.empty();}
+		inline bool IsEmptyDir() const {return IsDirectory() && files_.empty() && subdirs_.empty() && !hardlinks_ && !dynlinks_;}
+	};
+	//index of the tree for the queries: the nodes by their names, the directories holding each node (a shared node 
+	//has several of them) and the counts of the nodes below each directory; it is built by the first query
+	//and the changes of the directories' entries keep it up to date (the threads change it under the lock)
+	class NodeIndex {
+	public:
+		NodeIndex() : built_(false) {}
+
+		inline bool IsBuilt() const {return built_;}
+		//indexes the trees of the roots, the directories are counted after their entries (a shared node once)
+		void Build(const vector<File *> &roots) {
+			Reset();
+			vector<std::pair<File *, bool> > stack;
+			for(size_t k = 0; k < roots.size(); ++k) stack.push_back(std::make_pair(roots[k], false));
+			File::FileSet::const_iterator i, last;
+			while(!stack.empty()) {
+				File *node = stack.back().first;
+				if(nodes_.count(node)) {stack.pop_back(); continue;}
+				if(!stack.back().second) {
+					stack.back().second = true;
+					for(i = node->files_.begin(), last = node->files_.end(); i != last; ++i) 
+						if(!nodes_.count(*i)) stack.push_back(std::make_pair(*i, false));
+					for(i = node->subdirs_.begin(), last = node->subdirs_.end(); i != last; ++i) 
+						if(!nodes_.count(*i)) stack.push_back(std::make_pair(*i, false));
+					continue;
+				}
+				stack.pop_back();
+				Usage counts = {0, 0, 0, 0};
+				for(i = node->files_.begin(), last = node->files_.end(); i != last; ++i) Add(counts, Total(*i, AddHolder(*i, node)), false);
+				for(i = node->subdirs_.begin(), last = node->subdirs_.end(); i != last; ++i) Add(counts, Total(*i, AddHolder(*i, node)), false);
+				nodes_[node].counts = counts;
+			}
+			built_ = true;
+		}
+		void Reset() {
+			names_.clear();
+			nodes_.clear();
+			built_ = false;
+		}
+		//the node is inserted into the directory, its counts are added to the directories holding the directory
+		void Attach(File *dir, File *node) {
+			std::lock_guard<std::mutex> guard(lock_);
+			Propagate(dir, Total(node, AddHolder(node, dir)), false);
+		}
+		//the node is erased from the directory
+		void Detach(File *dir, File *node) {
+			std::lock_guard<std::mutex> guard(lock_);
+			Propagate(dir, Total(node, RemoveHolder(node, dir)), true);
+		}
+		//the node of the directory is replaced with its copy (they have the same counts)
+		void Replace(File *dir, File *node, File *copy) {
+			std::lock_guard<std::mutex> guard(lock_);
+			RemoveHolder(node, dir);
+			AddHolder(copy, dir);
+		}
+		//the node is deleted
+		void Forget(File *node) {
+			std::lock_guard<std::mutex> guard(lock_);
+			nodes_.erase(node);
+		}
+		//collects the paths of the nodes below the directory (with the path) whose names match the pattern,
+		//the nodes are looked up by the pattern's part preceding the wildcards (a dynamic link is named
+		//after the current path of its target, so it is found by the name it is shown with)
+		void Find(string_view pattern, const File *dir, const string &path, vector<string> &paths) const {
+			size_t wild = pattern.find_first_of("*?");
+			bool exact = wild == string_view::npos;
+			string_view prefix = pattern.substr(0, wild);
+			NameSet::const_iterator i = names_.lower_bound(NameSet::value_type(prefix, 0)), last = names_.end();
+			for(; i != last && (exact ? i->first == pattern : i->first.substr(0, prefix.size()) == prefix); ++i)
+				if(exact || MatchGlob(pattern, i->first)) CollectPaths(i->second, dir, path, string(), paths);
+		}
+		Usage GetCounts(const File *dir) const {
+			NodeMap::const_iterator e = nodes_.find(dir);
+			if(e != nodes_.end()) return e->second.counts;
+			Usage none = {0, 0, 0, 0};
+			return none;
+		}
+	private:
+		//the directories holding the node (a node usually has one) and the counts of the nodes below a directory
+		struct Entry {
+			File *holder;
+			vector<File *> more;
+			Usage counts;
+			Entry() : holder(0) {counts.files = counts.directories = counts.hardlinks = counts.dynlinks = 0;}
+		};
+		typedef std::unordered_map<const File *, Entry> NodeMap;
+		//the names are views into the nodes' names, a link is renamed while it is not in a directory
+		//(a moved node's dynamic links are detached, renamed and attached again, which re-keys them here)
+		typedef set<std::pair<string_view, File *>, std::less<std::pair<string_view, File *> >, 
+		            PoolAllocator<std::pair<string_view, File *> > > NameSet;
+		NameSet names_;
+		NodeMap nodes_;
+		bool built_;
+		std::mutex lock_;
+
+		//the node gets the directory, the node with a directory is named in the index
+		Entry &AddHolder(File *node, File *dir) {
+			Entry &e = nodes_[node];
+			if(e.holder) e.more.push_back(dir);
+			else {
+				e.holder = dir;
+				names_.insert(NameSet::value_type(node->name_, node));
+			}
+			return e;
+		}
+		Entry &RemoveHolder(File *node, File *dir) {
+			Entry &e = nodes_[node];
+			if(e.holder != dir) e.more.erase(find(e.more.begin(), e.more.end(), dir));
+			else if(e.more.empty()) {
+				e.holder = 0;
+				names_.erase(NameSet::value_type(node->name_, node));
+			}
+			else {
+				e.holder = e.more.back();
+				e.more.pop_back();
+			}
+			return e;
+		}
+		//counts of the node with the nodes below it
+		static Usage Total(const File *node, const Entry &e) {
+			Usage u = e.counts;
+			switch(node->type_) {
+			case File::file: ++u.files; break;
+			case File::directory: ++u.directories; break;
+			case File::hardlink: ++u.hardlinks; break;
+			case File::dynlink: ++u.dynlinks; break;
+			}
+			return u;
+		}
+		static void Add(Usage &to, const Usage &u, bool remove) {
+			if(remove) {to.files -= u.files; to.directories -= u.directories; to.hardlinks -= u.hardlinks; to.dynlinks -= u.dynlinks;}
+			else {to.files += u.files; to.directories += u.directories; to.hardlinks += u.hardlinks; to.dynlinks += u.dynlinks;}
+		}
+		//adds (subtracts) the counts to the directory and the directories above it (by each path)
+		void Propagate(File *dir, const Usage &u, bool remove) {
+			Entry &e = nodes_[dir];
+			Add(e.counts, u, remove);
+			if(e.holder) Propagate(e.holder, u, remove);
+			for(size_t k = 0; k < e.more.size(); ++k) Propagate(e.more[k], u, remove);
+		}
+		//collects the paths of the node (ending with the tail) going through the directory by walking up
+		//the directories holding the nodes, a node which is not in the tree has none
+		void CollectPaths(const File *node, const File *dir, const string &path, const string &tail, vector<string> &paths) const {
+			if(node == dir) {paths.push_back(path + tail); return;}
+			NodeMap::const_iterator e = nodes_.find(node);
+			if(e == nodes_.end() || !e->second.holder) return;
+			string sub = "\\" + node->name_ + tail;
+			CollectPaths(e->second.holder, dir, path, sub, paths);
+			for(size_t k = 0; k < e->second.more.size(); ++k) CollectPaths(e->second.more[k], dir, path, sub, paths);
+		}
 	};
 
-	//tokenizes the input string according to given delimiters and fills tokens into vector
-	static void TokenizeString(const string &s, vector<string> &strs, const string &delims = "\\") {
-		char *context = 0;
-		strs.clear();
-		char *sdup = _strdup(s.c_str()), *ps = strtok_s(sdup, delims.c_str(), &context);
-		while(ps) {strs.push_back(ps);  ps = strtok_s(0, delims.c_str(), &context);}
-		free(sdup);
+	//iterates over the components of a path, the components are views into the path string,
+	//backslashes inside of [] belong to the component (link names contain the paths)
+	class PathCursor {
+	public:
+		explicit PathCursor(string_view path) : path_(path), pos_(0) {}
+		//gets the next non-empty component
+		bool Next(string_view &comp) {
+			while(pos_ < path_.size()) {
+				size_t start = pos_, depth = 0;
+				for(; pos_ < path_.size() && (depth || path_[pos_] != '\\'); ++pos_)
+					if(path_[pos_] == '[') ++depth;
+					else if(path_[pos_] == ']' && depth) --depth;
+				comp = path_.substr(start, pos_ - start);
+				if(pos_ < path_.size()) ++pos_;
+				if(!comp.empty()) return true;
+			}
+			return false;
+		}
+	private:
+		string_view path_;
+		size_t pos_;
+	};
+	//checks if the path starts with the drive
+	static bool IsAbsPath(string_view path) {
+		return path.length() >= 2 && (path[0] == 'C' || path[0] == 'c') && path[1] == ':';
 	}
+	//checks if the path is the drive itself
+	static bool IsRootPath(string_view path) {return path.length() == 2 && IsAbsPath(path);}
 	//makes an absolute path 
-	string MakeAbsPath(const string &path) {
-		return ((path[0] == 'C' || path[0] == 'c') && path[1] == ':') ? path : curdir_ + string("\\") + path;
+	string MakeAbsPath(string_view path) {
+		return IsAbsPath(path) ? string(path) : curdir_ + "\\" + string(path);
+	}
+	//checks if all the components of the prefix path start the path (both paths are absolute)
+	static bool IsPathPrefix(string_view prefix, string_view path) {
+		PathCursor pc1(prefix), pc2(path);
+		string_view c1, c2;
+		while(pc1.Next(c1))
+			if(!pc2.Next(c2) || c1 != c2) return false;
+		return true;
 	}
 	//validates a file name
-	static bool IsValidFileName(const string &fname) {
+	static bool IsValidFileName(string_view fname) {
 		if(!fname.length()) return false;
 		if(fname == "C:" || fname == "c:") return true;
 
 		string ext, name;
 		bool afterpnt = false;
-		for(string::const_reverse_iterator i = fname.rbegin(), last = fname.rend(); i != last; ++i) {
+		for(string_view::const_reverse_iterator i = fname.rbegin(), last = fname.rend(); i != last; ++i) {
 			if(!afterpnt && *i == '.') {afterpnt = true; continue;}
 			if((*i < 'a' || *i > 'z') &&
 			   (*i < 'A' || *i > 'Z') &&
@@ -329,108 +974,797 @@ protected:
 		if(name == "") {name = ext; ext = "";}
 		return name.length() <= 8 && ext.length() <= 3;
 	}
+	//matches the name against the pattern: * stands for any characters, ? for any character
+	static bool MatchGlob(string_view pattern, string_view name) {
+		size_t p = 0, n = 0, star = string_view::npos, mark = 0;
+		while(n < name.size()) {
+			if(p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {++p; ++n;}
+			else if(p < pattern.size() && pattern[p] == '*') {star = p++; mark = n;}
+			else if(star != string_view::npos) {p = star + 1; n = ++mark;}
+			else return false;
+		}
+		while(p < pattern.size() && pattern[p] == '*') ++p;
+		return p == pattern.size();
+	}
+	//returns the current directory, it is resolved once and cached until a directory gets deleted
+	//or the nodes get shared/unshared, the cached directory is always writable
+	File* CurDir() {
+		if(!curnode_) curnode_ = WalkDirs(&root_, curdir_, true);
+		return curnode_;
+	}
+	//walks the directories of the path starting from the given directory, the drive of an absolute 
+	//path is skipped, the walk for writing makes private copies of the shared directories on the way
+	File* WalkDirs(File *dir, string_view path, bool writable) {
+		string_view comp;
+		PathCursor pc(path);
+		if(IsAbsPath(path)) pc.Next(comp);
+		size_t depth = 0;
+		for(; dir && pc.Next(comp); ++depth) {
+			File *sub = dir->HasDir(comp);
+			dir = sub && writable ? Unshare(dir, sub) : sub;
+		}
+		FM_STAT(Stats &st = CurrentStats(); ++st.walks; st.steps += depth; st.maxDepth = std::max<std::uint64_t>(st.maxDepth, depth));
+		return dir;
+	}
 	//validates a path and returns corresponding object's pointer
-	File* Path2File(const string &path) {
+	File* Path2File(string_view path, bool writable = false) {
 		if(!path.length()) return 0;
-
-		bool found;
-		File *file = &root_;
-		vector<string> dirs;
-		string path__ = MakeAbsPath(path);
-
-		File::FileSet::const_iterator start = root_.subdirs_.begin(), end = root_.subdirs_.end(), ii;
-		TokenizeString(path__, dirs);
-		
-		for(size_t i = 1, n = dirs.size(); i < n; ++i) {
-			found = false;
-			for(ii = start; ii != end; ++ii)
-				if((*ii)->name_ == dirs[i]) {
-					found = true; 
-					start = (*ii)->subdirs_.begin(); 
-					end = (*ii)->subdirs_.end();
-					file = *ii;
-					break;
-				}
-			if(!found) return 0;
-		}
-		return file;
+		return IsAbsPath(path) ? WalkDirs(&root_, path, writable) : WalkDirs(CurDir(), path, writable);
+	}
+	//validates the parent directory's path of a file/directory, returns the parent directory's 
+	//pointer and the name of the file/directory (a view into the path)
+	File* ResolveParent(string_view path, string_view &name, bool writable = false) {
+		string_view ppath;
+		SplitPath(path, ppath, name);
+		if(!ppath.length()) return IsAbsPath(path) ? 0 : CurDir();
+		return Path2File(ppath, writable);
+	}
+	//returns the private node of the directory, the shared node is replaced with its copy,
+	//which shares the children in turn
+	File* Unshare(File *dir, File *node) {
+		if(node->refs_ == 1) {node->parent_ = dir; return node;}
+		File *copy = new File(node->name_, node->type_, dir);
+		FM_STAT(++CurrentStats().unshared);
+		copy->files_ = node->files_;
+		copy->subdirs_ = node->subdirs_;
+		NodeIndex *index = Indexed();
+		File::FileSet::const_iterator i, last;
+		for(i = copy->files_.begin(), last = copy->files_.end(); i != last; ++i) {++(*i)->refs_; if(index) index->Attach(copy, *i);}
+		for(i = copy->subdirs_.begin(), last = copy->subdirs_.end(); i != last; ++i) {++(*i)->refs_; if(index) index->Attach(copy, *i);}
+		File::FileSet &set = Entries(dir, node);
+		set.insert(set.erase(set.find(node)), copy);
+		if(index) index->Replace(dir, node, copy);
+		//the logged node is kept for the rollback, otherwise another thread may have unshared it meanwhile,
+		//the last holder deletes it
+		if(Log()) Record(UndoRecord::replace, dir, node, copy);
+		else node->Release(index);
+		ResetCurDir();
+		return copy;
+	}
+	//the entries of the directory of the node's kind
+	static File::FileSet &Entries(File *dir, const File *node) {return node->IsDirectory() ? dir->subdirs_ : dir->files_;}
+	//marks the node and its parents as having links
+	static void MarkLinks(File *node) {
+		for(; node && !node->haslinks_; node = node->parent_) node->haslinks_ = true;
+	}
+	//clears the marks of the node and its parents whose subtrees have no links or link targets left
+	//(a marked node isn't shared, so its parents are valid), the copies of such subtrees share them again
+	static void UnmarkLinks(File *node) {
+		for(; node && node->haslinks_ && !HasLinked(node); node = node->parent_) node->haslinks_ = false;
+	}
+	//checks if the node is a link or a link target or it has marked entries
+	static bool HasLinked(const File *node) {
+		if(node->IsHardLink() || node->IsDynLink() || node->HasHardLinks() || node->HasDynLinks()) return true;
+		File::FileSet::const_iterator i, last;
+		for(i = node->files_.begin(), last = node->files_.end(); i != last; ++i) if((*i)->haslinks_) return true;
+		for(i = node->subdirs_.begin(), last = node->subdirs_.end(); i != last; ++i) if((*i)->haslinks_) return true;
+		return false;
 	}
-	//splits the input full path into parent directory's path and file/directory name
-	void SplitPath(const string &path, string &ppath, string &fname) {
-		ppath = fname = "";
-		bool afterslash = false, betweenbraces = false;
-		for(string::const_reverse_iterator i = path.rbegin(), last = path.rend(); i!=last; ++i) {
-			if(*i == ']') betweenbraces = true;
-			if(*i == '[') betweenbraces = false;
-			if(!afterslash && !betweenbraces && *i == '\\') {afterslash = true; continue;}
-			afterslash ? ppath += *i : fname += *i;
+	//splits the input path into parent directory's path and file/directory name
+	static void SplitPath(string_view path, string_view &ppath, string_view &fname) {
+		size_t sep = string_view::npos, depth = 0;
+		for(size_t i = 0, n = path.length(); i < n; ++i)
+			if(path[i] == '[') ++depth;
+			else if(path[i] == ']' && depth) --depth;
+			else if(!depth && path[i] == '\\') sep = i;
+		if(sep == string_view::npos) {
+			ppath = string_view();
+			fname = path;
+		}
+		else {
+			ppath = path.substr(0, sep);
+			fname = path.substr(sep + 1);
 		}
-		reverse(ppath.begin(), ppath.end());
-		reverse(fname.begin(), fname.end());
 	}
-	//duplicates node's structure and inserts into destination node, returns the newly duplicated node
-	File* CopyTree(File *node, File *dst) {
-		File* new_node = new File(node->name_, node->type_, dst), *p;
-		new_node->dlinks_ = node->dlinks_;
-		new_node->hlinks_ = node->hlinks_;
+	//copies the node for the destination directory, the subtrees without links are shared 
+	//(if sharing is allowed), the others are duplicated (the links to them are not)
+	File* CopyTree(File *node, File *dst, bool share) {
+		if(share && !node->haslinks_) {++node->refs_; FM_STAT(++CurrentStats().shared); return node;}
+		File* new_node = CopyNode(node, dst), *p;
+		NodeIndex *index = Indexed();
 
 		File::FileSet::const_iterator start = node->files_.begin(), end = node->files_.end(), i;
 		for(i = start; i != end; ++i) {
-			p = new File((*i)->name_, (*i)->type_, new_node);
-			p->dlinks_ = (*i)->dlinks_;
-			p->hlinks_ = (*i)->hlinks_;
+			if(share && !(*i)->haslinks_) {p = *i; ++p->refs_; FM_STAT(++CurrentStats().shared);}
+			else p = CopyNode(*i, new_node);
 			new_node->files_.insert(p);
+			if(index) index->Attach(new_node, p);
 		}
 		start = node->subdirs_.begin();
 		end = node->subdirs_.end();
-		for(i = start; i != end; ++i) new_node->subdirs_.insert(CopyTree(*i, new_node));
+		for(i = start; i != end; ++i) {
+			p = CopyTree(*i, new_node, share);
+			new_node->subdirs_.insert(p);
+			if(index) index->Attach(new_node, p);
+		}
 		return new_node;
 	}
-	//updates the dynamic links to the files/directories present in source
-	//generally needed after move command
-	void UpdateDynLinks(const string &path) {
-		string ppath, name;
-		File *dir, *file;
-		SplitPath(path, ppath, name);
-		dir = Path2File(ppath);
-		file = dir->HasDir(name);
-		if(!file) file = dir->HasFile(name);
-		if(!file) return;
-
-		//update current file/directory
-		File::LinkMap::const_iterator i = file->dlinks_.begin(), last = file->dlinks_.end();
-		for(; i != last; ++i)
-			i->first->name_ = "dlink[" + path + "]";
-
-		//update all files if 'file' is directory
-		File::FileSet::const_iterator ii = file->files_.begin(), llast = file->files_.end();
-		for(; ii != llast; ++ii)
-			for(i = (*ii)->dlinks_.begin(), last = (*ii)->dlinks_.end(); i != last; ++i)
-				i->first->name_ = "dlink[" + path + "\\" + (*ii)->name_+ "]";
-
-		//update all subdirectories if file is directory
-		ii = file->subdirs_.begin();
-		llast = file->subdirs_.end();
-		for(; ii != llast; ++ii) UpdateDynLinks(path + "\\" + (*ii)->name_);
-	}
-	void DelDir(File *dir, bool ignore_hard_links = true) {
-		if(!dir) return;
-		if(!ignore_hard_links && dir->HasHardLinks())
-			ErrorMsg("Cannot delete " + dir->name_ + ", it has hard links, the program will terminate");
-
-		//delete the files
-		dir->DeleteFiles(ignore_hard_links);
-		//delete the subdirectories
-		while(!(dir->subdirs_.empty())) DelDir(*(dir->subdirs_.begin()), ignore_hard_links);
-		dir->subdirs_.clear();
-		//notify the parent directory about deletion and delete itself
-		if(dir != &root_) {
-			dir->parent_->subdirs_.erase(dir);
-			delete dir;
-		}
-	}
-	static void ToLower(string &s) {for(size_t i = 0, n = s.size(); i < n; s[i] = tolower(s[i]), ++i);}
+	//duplicates a single node for the directory, a link is duplicated with the same target (it marks
+	//the directories above it), the copy of a target is not a target
+	File* CopyNode(File *node, File *dir) {
+		FM_STAT(++CurrentStats().copied);
+		if(node->IsHardLink() || node->IsDynLink()) return MakeLink(node->name_, node->type_, dir, node->target_);
+		return new File(node->name_, node->type_, dir);
+	}
+	//creates a link to the target for the directory, the links are indexed by the targets
+	File* MakeLink(const string &name, File::Type t, File *dir, File *target) {
+		File *lnk = new File(name, t, dir);
+		lnk->target_ = target;
+		RegisterLink(lnk);
+		FM_STAT(++CurrentStats().links);
+		Record(UndoRecord::link, 0, lnk);
+		MarkLinks(target);
+		MarkLinks(lnk);
+		return lnk;
+	}
+	//links by their targets
+	typedef std::multimap<File *, File *, std::less<File *>, PoolAllocator<std::pair<File * const, File *> > > LinkIndex;
+	//finds the link of the kind to the target placed in the directory
+	File* FindLink(File *dir, File *target, File::Type t = File::dynlink) const {
+		const LinkIndex &links = t == File::hardlink ? hlinks_ : dlinks_;
+		std::pair<LinkIndex::const_iterator, LinkIndex::const_iterator> r = links.equal_range(target);
+		for(LinkIndex::const_iterator i = r.first; i != r.second; ++i)
+			if(i->second->parent_ == dir) return i->second;
+		return 0;
+	}
+	//looks up a file in the directory, the dynamic links are looked up by their targets
+	File* FindFile(File *dir, string_view name) {
+		if(name.size() < 7 || name.substr(0, 6) != "dlink[" || name.back() != ']') return dir->HasFile(name);
+		string_view tname;
+		File *tdir = ResolveParent(name.substr(6, name.size() - 7), tname), *target;
+		if(!tdir) return 0;
+		target = tdir->HasDir(tname);
+		if(!target) target = FindFile(tdir, tname);
+		return target ? FindLink(dir, target) : 0;
+	}
+	//renames the links to the node after its current path (the directories stay ordered by
+	//the shown names), the links to the renamed links are renamed in turn
+	void RenameLinks(File *node) {
+		string path = node->GetPath();
+		if(node->HasHardLinks()) RenameLinks(hlinks_, node, "hlink[" + path + "]");
+		if(node->HasDynLinks()) RenameLinks(dlinks_, node, "dlink[" + path + "]");
+	}
+	void RenameLinks(const LinkIndex &links, File *node, const string &name) {
+		std::pair<LinkIndex::const_iterator, LinkIndex::const_iterator> r = links.equal_range(node);
+		for(LinkIndex::const_iterator i = r.first; i != r.second; ++i) {
+			File *lnk = i->second;
+			if(lnk->name_ == name) continue;
+			Detach(lnk->parent_, lnk);
+			Record(UndoRecord::rename, 0, lnk, 0, lnk->name_);
+			lnk->name_ = name;
+			Attach(lnk->parent_, lnk);
+			if(lnk->HasHardLinks() || lnk->HasDynLinks()) RenameLinks(lnk);
+		}
+	}
+	//counts the link at its target, the links are indexed by the targets
+	void RegisterLink(File *lnk) {
+		if(lnk->IsHardLink()) ++lnk->target_->hardlinks_;
+		else ++lnk->target_->dynlinks_;
+		(lnk->IsHardLink() ? hlinks_ : dlinks_).insert(LinkIndex::value_type(lnk->target_, lnk));
+	}
+	//removes the link from its target's counts and the index
+	void UnregisterLink(File *lnk) {
+		LinkIndex &links = lnk->IsHardLink() ? hlinks_ : dlinks_;
+		LinkIndex::iterator i = links.lower_bound(lnk->target_);
+		while(i->second != lnk) ++i;
+		links.erase(i);
+		if(lnk->IsHardLink()) --lnk->target_->hardlinks_;
+		else --lnk->target_->dynlinks_;
+	}
+	//collects the nodes of the subtree having (or having had) links in the order of the removal:
+	//the directory, its files, its subdirectories
+	static void CollectLinked(File *node, vector<File *> &nodes) {
+		if(!node->haslinks_) return;
+		nodes.push_back(node);
+		File::FileSet::const_iterator i, last;
+		for(i = node->files_.begin(), last = node->files_.end(); i != last; ++i) CollectLinked(*i, nodes);
+		for(i = node->subdirs_.begin(), last = node->subdirs_.end(); i != last; ++i) CollectLinked(*i, nodes);
+	}
+	//finds the node having hard links when its turn to be removed comes, 
+	//the hard links of the subtree removed before it don't count
+	static File* FindHardLinked(const vector<File *> &nodes) {
+		map<File *, unsigned> removed;
+		for(size_t i = 0, n = nodes.size(); i < n; ++i) {
+			File *node = nodes[i];
+			if(node->HasHardLinks()) {
+				map<File *, unsigned>::const_iterator r = removed.find(node);
+				if(r == removed.end() || r->second < node->hardlinks_) return node;
+			}
+			if(node->IsHardLink()) ++removed[node->target_];
+		}
+		return 0;
+	}
+	//removes the node with its subtree from the directory: the links of the subtree are unregistered
+	//and the dynamic links to the subtree's nodes are removed (the caller checks the hard links)
+	void RemoveNode(File *dir, File *node, const vector<File *> *linked = 0) {
+		vector<File *> nodes;
+		if(!linked) {CollectLinked(node, nodes); linked = &nodes;}
+		Detach(dir, node);
+		size_t i, n = linked->size();
+		FM_STAT(Stats &st = CurrentStats(); ++st.removed; st.visited += n);
+		for(i = 0; i < n; ++i)
+			if((*linked)[i]->IsHardLink() || (*linked)[i]->IsDynLink()) {
+				UnregisterLink((*linked)[i]);
+				FM_STAT(++CurrentStats().unlinks);
+				Record(UndoRecord::unlink, 0, (*linked)[i]);
+			}
+		//the remaining dynamic links to the subtree are outside of it
+		for(i = 0; i < n; ++i)
+			while((*linked)[i]->HasDynLinks()) {
+				File *lnk = dlinks_.find((*linked)[i])->second;
+				RemoveNode(lnk->parent_, lnk);
+			}
+		//the targets and the directory may have no links left
+		for(i = 0; i < n; ++i)
+			if((*linked)[i]->IsHardLink() || (*linked)[i]->IsDynLink()) UnmarkLinks((*linked)[i]->target_);
+		UnmarkLinks(dir);
+		Drop(node);
+		ResetCurDir();
+	}
+	//removes the directory with its subtree from the parent directory,
+	//nothing is removed if a node of the subtree has hard links
+	Status DelDir(File *pardir, File *dir) {
+		vector<File *> nodes;
+		CollectLinked(dir, nodes);
+		File *node = FindHardLinked(nodes);
+		if(node && node->IsDirectory()) return Fail(stHardLinks, "Cannot delete " + node->name_ + ", it has hard links");
+		if(node) return Fail(stHardLinks, "Cannot delete " + node->name_ + " file, it has hard link(s)");
+		RemoveNode(pardir, dir, &nodes);
+		return stOk;
+	}
+	//change of the tree kept by the undo log
+	struct UndoRecord {
+		enum Kind {
+			take,		//the node is created or shared, the rollback releases it
+			attach,		//the node is inserted into the directory
+			detach,		//the node is erased from the directory
+			drop,		//the node is removed, the log holds it till the commit
+			replace,	//the shared node is replaced with its copy, the log holds it till the commit
+			reparent,	//the node is moved from the directory
+			link,		//the link is registered
+			unlink,		//the link is unregistered
+			rename,		//the node had the name
+			chdir		//the current directory was the path
+		};
+		Kind kind;
+		File *dir, *node, *other;
+		string text;
+		UndoRecord(Kind k, File *d, File *n, File *o, const string &t) : kind(k), dir(d), node(n), other(o), text(t) {}
+	};
+	typedef vector<UndoRecord> UndoLog;
+	//the log of the changes if they are logged: the log of the thread's task or the log of the transactions
+	UndoLog *Log() {
+		Task *task = CurrentTask();
+		if(task) return task->logged ? &task->log : 0;
+		return marks_.empty() ? 0 : &log_;
+	}
+	void Record(UndoRecord::Kind k, File *dir, File *node, File *other = 0, const string &text = string()) {
+		UndoLog *log = Log();
+		if(log) log->push_back(UndoRecord(k, dir, node, other, text));
+	}
+	//the primitive changes of the tree, the commands change it by them (besides the names and links)
+	File* Take(File *node) {Record(UndoRecord::take, 0, node); return node;}
+	void Attach(File *dir, File *node) {
+		Entries(dir, node).insert(node);
+		if(Indexed()) index_.Attach(dir, node);
+		Record(UndoRecord::attach, dir, node);
+	}
+	void Detach(File *dir, File *node) {
+		Entries(dir, node).erase(node);
+		if(Indexed()) index_.Detach(dir, node);
+		Record(UndoRecord::detach, dir, node);
+	}
+	void Drop(File *node) {
+		if(Log()) Record(UndoRecord::drop, 0, node);
+		else node->Release(Indexed());
+	}
+	//reverts the changes logged since the position, the nodes are released when the tree is restored
+	void Undo(UndoLog &log, size_t pos) {
+		vector<File *> released;
+		NodeIndex *index = Indexed();
+		for(size_t i = log.size(); i-- > pos; ) {
+			const UndoRecord &r = log[i];
+			switch(r.kind) {
+			case UndoRecord::take: released.push_back(r.node); break;
+			case UndoRecord::attach: 
+				Entries(r.dir, r.node).erase(r.node); 
+				if(index) index->Detach(r.dir, r.node);
+				break;
+			case UndoRecord::detach: 
+				Entries(r.dir, r.node).insert(r.node); 
+				if(index) index->Attach(r.dir, r.node);
+				if(r.node->haslinks_) MarkLinks(r.dir);
+				break;
+			case UndoRecord::drop: break;
+			case UndoRecord::replace: {
+				File::FileSet &set = Entries(r.dir, r.node);
+				set.insert(set.erase(set.find(r.other)), r.node);
+				if(index) index->Replace(r.dir, r.other, r.node);
+				released.push_back(r.other);
+				break;
+			}
+			case UndoRecord::reparent: r.node->parent_ = r.dir; break;
+			case UndoRecord::link: UnregisterLink(r.node); break;
+			case UndoRecord::unlink: RegisterLink(r.node); MarkLinks(r.node->target_); break;
+			case UndoRecord::rename: r.node->name_ = r.text; break;
+			case UndoRecord::chdir: curdir_ = r.text; break;
+			}
+		}
+		log.erase(log.begin() + pos, log.end());
+		for(size_t i = 0; i < released.size(); ++i) released[i]->Release(index);
+		ResetCurDir();
+	}
+	//makes the changes logged since the position permanent, the nodes held by the log are released
+	void Finalize(UndoLog &log, size_t pos) {
+		NodeIndex *index = Indexed();
+		for(size_t i = pos; i < log.size(); ++i)
+			if(log[i].kind == UndoRecord::drop) log[i].node->Release(index);
+			else if(log[i].kind == UndoRecord::replace) log[i].node->Release(index);
+		log.erase(log.begin() + pos, log.end());
+	}
+	//rolls the transactions back to the nesting depth
+	void RollbackTo(size_t depth) {
+		if(marks_.size() <= depth) return;
+		Undo(log_, marks_[depth].log);
+		pending_.resize(marks_[depth].journal);
+		marks_.erase(marks_.begin() + depth, marks_.end());
+	}
+	//keeps the message of the failed command (the message of the thread's task) and returns its status
+	Status Fail(Status st, const string &msg) {
+		Task *task = CurrentTask();
+		(task ? task->error : error_) = msg;
+		return st;
+	}
+	//commands to execute in parallel with their top-level directories
+	struct Group {
+		Program commands;
+		vector<File *> dirs;
+	};
+	//commands of a top-level directory executed by a thread: their indices in the group, the log of their 
+	//changes (if they are logged) with the commands' positions, the first failed one with its status and message, 
+	//the errors of the failed ones
+	struct Task {
+		vector<size_t> commands;
+		bool logged;
+		UndoLog log;
+		vector<size_t> marks;
+		size_t failed;
+		Status status;
+		string message;
+		string error;
+		vector<std::pair<size_t, string> > errors;
+#ifdef FM_STATS
+		Stats stats;
+#endif
+		Task() : logged(false), failed(0), status(stOk) {}
+	};
+	//the task being executed by the thread
+	static Task *&CurrentTask() {static thread_local Task *task = 0; return task;}
+#ifdef FM_STATS
+	//the counters of the thread's task or of the emulator, the tasks' ones are added when the threads are done
+	Stats &CurrentStats() {
+		Task *task = CurrentTask();
+		return task ? task->stats : stats_;
+	}
+#endif
+	//beginning of a transaction: the positions in the undo log and in the journal
+	struct Mark {
+		size_t log, journal;
+		Mark(size_t l, size_t j) : log(l), journal(j) {}
+	};
+	//appends the executed command to the journal, the commands of the transactions wait for the commit
+	void Journal(const Command &c) {
+		if(!journal_.is_open()) return;
+		pending_.append(GetOpName(c.op));
+		if(c.arg1.size()) pending_.append(1, ' ').append(c.arg1);
+		if(c.arg2.size()) pending_.append(1, ' ').append(c.arg2);
+		pending_.push_back('\n');
+		if(marks_.empty()) {journal_.write(pending_.data(), pending_.size()); pending_.clear();}
+	}
+	//writes the committed commands to the journal
+	void WriteJournal() {
+		if(!journal_.is_open()) return;
+		journal_.write(pending_.data(), pending_.size());
+		journal_.flush();
+		pending_.clear();
+	}
+	static const char *GetOpName(Opcode op) {
+		static const char *names[] = {"", "md", "cd", "rd", "deltree", "mf", "mhl", "mdl", "del", "copy", "move", "begin", "commit", "checkpoint"};
+		return names[op];
+	}
+	//commands count below which spawning one more thread doesn't pay off
+	static const size_t MinCommandsPerThread = 1024;
+
+	//splits the line into the command and its arguments (the rest of the line is ignored),
+	//returns false for the empty lines and the unknown commands
+	static bool ParseCommand(string_view line, Command &c) {
+		string_view tokens[3];
+		size_t n = 0, i = 0, size = line.size(), start;
+		while(n < 3) {
+			while(i < size && IsSpace(line[i])) ++i;
+			if(i == size) break;
+			for(start = i; i < size && !IsSpace(line[i]); ++i);
+			tokens[n++] = line.substr(start, i - start);
+		}
+		if(!n) return false;
+		c.op = GetOpcode(tokens[0]);
+		c.arg1 = tokens[1];
+		c.arg2 = tokens[2];
+		return c.op != opNone;
+	}
+	static bool IsSpace(char c) {return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';}
+	//looks the command's name up (case insensitive) in the perfect hash table of the names
+	static Opcode GetOpcode(string_view name) {
+		struct Keyword {
+			const char *name;
+			Opcode op;
+		};
+		static const Keyword keywords[32] = {
+			{"md", opMD}, {"mdl", opMDL}, {"mf", opMF}, {0, opNone}, {0, opNone}, {"mhl", opMHL}, {0, opNone}, {0, opNone},
+			{0, opNone}, {0, opNone}, {"rd", opRD}, {0, opNone}, {"cd", opCD}, {"move", opMove}, {"begin", opBegin}, {0, opNone},
+			{"del", opDel}, {0, opNone}, {0, opNone}, {0, opNone}, {"deltree", opDelTree}, {0, opNone}, {0, opNone}, {0, opNone},
+			{"checkpoint", opCheckpoint}, {"copy", opCopy}, {0, opNone}, {"commit", opCommit}, {0, opNone}, {0, opNone}, {0, opNone}, {0, opNone}
+		};
+		if(name.size() < 2) return opNone;
+		const Keyword &k = keywords[(2 * (name[0] | 0x20) + (name[1] | 0x20) + name.size()) & 31];
+		if(!k.name) return opNone;
+		size_t i = 0;
+		for(; i < name.size(); ++i)
+			if(!k.name[i] || tolower(static_cast<unsigned char>(name[i])) != k.name[i]) return opNone;
+		return k.name[i] ? opNone : k.op;
+	}
+	//executes a command, its latency is recorded by the instrumentation
+	Status Execute(const Command &c) {
+#ifdef FM_STATS
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		Status st = Dispatch(c);
+		std::uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		if(c.op < opBegin) {
+			Stats::Command &sc = CurrentStats().commands[c.op];
+			size_t k = 0;
+			while(k < 39 && (std::uint64_t(2) << k) <= ns) ++k;
+			++sc.count;
+			sc.failed += st != stOk;
+			sc.time += ns;
+			++sc.buckets[k];
+		}
+		return st;
+#else
+		return Dispatch(c);
+#endif
+	}
+	Status Dispatch(const Command &c) {
+		switch(c.op) {
+		case opMD: return MakeDirectory(c.arg1);
+		case opCD: return ChangeCurDirectory(c.arg1);
+		case opRD: return RemoveDirectory(c.arg1);
+		case opDelTree: return DeleteTree(c.arg1);
+		case opMF: return MakeFile(c.arg1);
+		case opMHL: return MakeHardLink(c.arg1, c.arg2);
+		case opMDL: return MakeDynamicLink(c.arg1, c.arg2);
+		case opDel: return DeleteFile(c.arg1);
+		case opCopy: return CopyFile(c.arg1, c.arg2);
+		case opMove: return MoveFile(c.arg1, c.arg2);
+		default: return stOk;
+		}
+	}
+	//executes the commands given by the source, the runs of the commands which can be executed in parallel
+	//are grouped (when the changes are not logged), the transactions of the batch are nested into the current one,
+	//in the rollback mode the batch is executed in a transaction, which is committed at each checkpoint
+	template<class Source>
+	Status Run(Source next, unsigned threads, ErrorMode mode) {
+		if(!threads) threads = std::max(1u, std::thread::hardware_concurrency());
+		size_t base = marks_.size(), floor = base, skip = 0;
+		if(mode == rollbackOnError) {BeginTransaction(); ++floor;}
+		Group group;
+		Command c;
+		Status result = stOk, st;
+		//the message of the first failed command
+		string message;
+		bool stopped = false;
+		errors_.clear();
+		for(bool more = true; more && !stopped; ) {
+			more = next(c);
+			//the commands of a failed transaction are skipped
+			if(more && skip) {
+				if(c.op == opBegin) ++skip;
+				else if(c.op == opCommit) --skip;
+				continue;
+			}
+			File *dir = more && threads > 1 && !Log() ? GetSubtree(c) : 0;
+			if(dir) {
+				group.commands.Add(c);
+				group.dirs.push_back(dir);
+				continue;
+			}
+			//the group is executed before a command which cannot join it (it is executed outside of the transactions)
+			st = ExecGroup(group, threads, mode);
+			if(st != stOk && result == stOk) {result = st; message = error_;}
+			if(st != stOk && mode != continueOnError) {stopped = true; break;}
+			if(!more) break;
+
+			if(c.op == opBegin) {BeginTransaction(); st = stOk;}
+			else if(c.op == opCommit) 
+				st = marks_.size() > floor ? CommitTransaction() : Fail(stNoTransaction, "COMMIT failed! There is no transaction");
+			else if(c.op == opCheckpoint) {
+				if(mode == rollbackOnError && marks_.size() == floor) {CommitTransaction(); BeginTransaction();}
+				st = stOk;
+			}
+			else if((st = Execute(c)) == stOk) Journal(c);
+			if(st == stOk) continue;
+			if(result == stOk) {result = st; message = error_;}
+			if(mode != continueOnError) stopped = true;
+			else {
+				//the failed transaction is rolled back and the rest of it is skipped
+				errors_.push_back(error_);
+				skip = marks_.size() - floor;
+				RollbackTo(floor);
+			}
+		}
+		//the unfinished transactions of the batch are rolled back
+		RollbackTo(stopped ? base : floor);
+		if(mode == rollbackOnError && !stopped) CommitTransaction();
+		if(journal_.is_open()) journal_.flush();
+		if(result != stOk) error_ = message;
+		return result;
+	}
+	//returns the top-level directory the command works in if it can be executed in parallel with the
+	//commands of the other top-level directories: it creates or removes an entry below the top level
+	//and there are no links in the directory (the directory is made private for the thread),
+	//the commands changing the root, the current directory, the links or several directories return 0
+	File* GetSubtree(const Command &c) {
+		if(c.op != opMD && c.op != opMF && c.op != opRD && c.op != opDelTree && c.op != opDel) return 0;
+		string_view path = c.arg1, top, comp;
+		PathCursor pc(path);
+		File *cur = IsAbsPath(path) ? &root_ : CurDir();
+		if(!cur) return 0;
+		if(IsAbsPath(path)) pc.Next(comp);
+		if(cur == &root_) {if(!pc.Next(top)) return 0;}
+		else {
+			PathCursor cc(curdir_);
+			cc.Next(comp);
+			cc.Next(top);
+		}
+		if(!pc.Next(comp)) return 0;
+		File *dir = root_.HasDir(top);
+		if(!dir || dir->haslinks_) return 0;
+		return Unshare(&root_, dir);
+	}
+	//executes the group of commands, the commands of a top-level directory are executed in their order
+	//by one of the threads, the threads take the directories one by one (the largest ones first);
+	//in the continue mode the errors are collected in the batch order when all the threads are done, otherwise 
+	//the changes are logged and the commands following the first failed one (in the batch order) are rolled back,
+	//returns the status of the first failed command (with its message)
+	Status ExecGroup(Group &group, unsigned threads, ErrorMode mode) {
+		size_t n = group.commands.GetSize(), t, k;
+		if(!n) return stOk;
+		map<File *, Task> dirs;
+		for(k = 0; k < n; ++k) dirs[group.dirs[k]].commands.push_back(k);
+		if(threads > dirs.size()) threads = static_cast<unsigned>(dirs.size());
+		if(threads > n / MinCommandsPerThread) threads = static_cast<unsigned>(n / MinCommandsPerThread);
+		Status result = stOk;
+		if(threads <= 1) {
+			string message;
+			for(k = 0; k < n; ++k) {
+				Status st = Execute(group.commands.Get(k));
+				if(st == stOk) {Journal(group.commands.Get(k)); continue;}
+				if(result == stOk) {result = st; message = error_;}
+				if(mode != continueOnError) break;
+				errors_.push_back(error_);
+			}
+			group.commands.Clear();
+			group.dirs.clear();
+			if(result != stOk) error_ = message;
+			return result;
+		}
+
+		vector<Task *> tasks;
+		for(map<File *, Task>::iterator i = dirs.begin(); i != dirs.end(); ++i) {
+			i->second.logged = mode != continueOnError;
+			i->second.failed = n;
+			tasks.push_back(&i->second);
+		}
+		std::sort(tasks.begin(), tasks.end(), [](const Task *a, const Task *b) {return a->commands.size() > b->commands.size();});
+		//the current directory is resolved in advance, the threads don't change it
+		CurDir();
+		parallel_ = true;
+		std::atomic<size_t> next(0);
+		vector<std::thread> pool;
+		for(t = 0; t < threads; ++t)
+			pool.push_back(std::thread([this, &group, &tasks, &next, n]() {
+				for(size_t j; (j = next++) < tasks.size(); ) {
+					Task &task = *tasks[j];
+					CurrentTask() = &task;
+					for(size_t i = 0; i < task.commands.size(); ++i) {
+						if(task.logged) task.marks.push_back(task.log.size());
+						Status st = Execute(group.commands.Get(task.commands[i]));
+						if(st == stOk) continue;
+						if(task.failed == n) {task.failed = task.commands[i]; task.status = st; task.message = task.error;}
+						if(task.logged) break;
+						task.errors.push_back(std::make_pair(task.commands[i], task.error));
+					}
+					CurrentTask() = 0;
+				}
+			}));
+		for(t = 0; t < threads; ++t) pool[t].join();
+		parallel_ = false;
+
+		Task *first = tasks[0];
+		vector<std::pair<size_t, string> > errors;
+		for(k = 0; k < tasks.size(); ++k) {
+			FM_STAT(stats_.Add(tasks[k]->stats));
+			if(tasks[k]->failed < first->failed) first = tasks[k];
+			errors.insert(errors.end(), tasks[k]->errors.begin(), tasks[k]->errors.end());
+		}
+		std::sort(errors.begin(), errors.end());
+		for(k = 0; k < errors.size(); ++k) errors_.push_back(errors[k].second);
+		for(k = 0; k < tasks.size(); ++k) {
+			Task &task = *tasks[k];
+			if(!task.logged) continue;
+			//the commands following the failed one are rolled back
+			size_t i = std::upper_bound(task.commands.begin(), task.commands.end(), first->failed) - task.commands.begin();
+			if(i < task.marks.size()) Undo(task.log, task.marks[i]);
+			Finalize(task.log, 0);
+		}
+		ResetCurDir();
+		//the executed commands are journaled in the batch order
+		size_t last = mode == continueOnError ? n : first->failed;
+		for(k = 0, t = 0; k < last; ++k)
+			if(t < errors.size() && errors[t].first == k) ++t;
+			else Journal(group.commands.Get(k));
+		group.commands.Clear();
+		group.dirs.clear();
+		if(first->failed == n) return stOk;
+		error_ = first->message;
+		return first->status;
+	}
+	//header of a snapshot file, the arrays of the nodes, of their children, of the names and the current directory follow it
+	struct SnapshotHeader {
+		char magic[8];
+		std::uint32_t version, byteOrder;
+		std::uint64_t nodes, children, names, curdir, checksum;
+	};
+	//node of a snapshot: its name in the names, its children (the files, then the subdirectories) 
+	//in the children array, the index of the target for a link
+	struct SnapshotNode {
+		std::uint32_t name, length, children, files, subdirs, type, haslinks, target;
+	};
+	static const std::uint32_t SnapshotVersion = 1, NoNode = 0xffffffff;
+
+	//numbers the nodes for the snapshot in post-order (the children precede their directory, the root is the last one),
+	//a shared node is numbered once; the tree is walked with an explicit stack
+	void CollectNodes(vector<SnapshotNode> &nodes, vector<std::uint32_t> &children, string &names) const {
+		std::unordered_map<const File *, std::uint32_t> index;
+		vector<const File *> order;
+		vector<std::pair<const File *, bool> > stack(1, std::make_pair(&root_, false));
+		File::FileSet::const_iterator i, last;
+		while(!stack.empty()) {
+			const File *node = stack.back().first;
+			if(index.count(node)) {stack.pop_back(); continue;}
+			if(!stack.back().second) {
+				stack.back().second = true;
+				for(i = node->files_.begin(), last = node->files_.end(); i != last; ++i) 
+					if(!index.count(*i)) stack.push_back(std::make_pair(*i, false));
+				for(i = node->subdirs_.begin(), last = node->subdirs_.end(); i != last; ++i) 
+					if(!index.count(*i)) stack.push_back(std::make_pair(*i, false));
+				continue;
+			}
+			stack.pop_back();
+			SnapshotNode sn = {std::uint32_t(names.size()), std::uint32_t(node->name_.size()), std::uint32_t(children.size()),
+			                   std::uint32_t(node->files_.size()), std::uint32_t(node->subdirs_.size()), 
+			                   std::uint32_t(node->type_), node->haslinks_, NoNode};
+			names.append(node->name_);
+			for(i = node->files_.begin(), last = node->files_.end(); i != last; ++i) children.push_back(index[*i]);
+			for(i = node->subdirs_.begin(), last = node->subdirs_.end(); i != last; ++i) children.push_back(index[*i]);
+			index[node] = std::uint32_t(nodes.size());
+			nodes.push_back(sn);
+			order.push_back(node);
+		}
+		for(size_t k = 0; k < order.size(); ++k)
+			if(order[k]->target_) nodes[k].target = index[order[k]->target_];
+	}
+	//checks the snapshot's nodes: the names and the children are in their arrays, the children precede 
+	//their directory and are ordered by the names, every node but the root has a directory and a node 
+	//with links has one, the links have targets, the root is the drive
+	static bool IsValidSnapshot(const vector<SnapshotNode> &nodes, const vector<std::uint32_t> &children, string_view names) {
+		size_t n = nodes.size();
+		if(!n || n >= NoNode) return false;
+		vector<unsigned> refs(n, 0);
+		for(size_t i = 0; i < n; ++i) {
+			const SnapshotNode &sn = nodes[i];
+			if(std::uint64_t(sn.name) + sn.length > names.size() || sn.type > File::dynlink) return false;
+			if((sn.type == File::hardlink || sn.type == File::dynlink) != (sn.target < n)) return false;
+			if(sn.type != File::directory && (sn.files || sn.subdirs)) return false;
+			if(std::uint64_t(sn.children) + sn.files + sn.subdirs > children.size()) return false;
+			for(std::uint32_t k = 0; k < sn.files + sn.subdirs; ++k) {
+				std::uint32_t c = children[sn.children + k];
+				if(c >= i || (nodes[c].type == File::directory) != (k >= sn.files)) return false;
+				if(k && k != sn.files) {
+					const SnapshotNode &prev = nodes[children[sn.children + k - 1]];
+					if(names.substr(prev.name, prev.length) >= names.substr(nodes[c].name, nodes[c].length)) return false;
+				}
+				++refs[c];
+			}
+		}
+		for(size_t i = 0; i + 1 < n; ++i)
+			if(!refs[i] || (nodes[i].haslinks && refs[i] > 1)) return false;
+		const SnapshotNode &root = nodes[n - 1];
+		return root.type == File::directory && names.substr(root.name, root.length) == "C:";
+	}
+	//checks if the trees have the same structure and names
+	static bool SameTree(const File *a, const File *b) {
+		if(a->type_ != b->type_ || a->GetDisplayName() != b->GetDisplayName()) return false;
+		if(a->files_.size() != b->files_.size() || a->subdirs_.size() != b->subdirs_.size()) return false;
+		File::FileSet::const_iterator i, j, last;
+		for(i = a->files_.begin(), last = a->files_.end(), j = b->files_.begin(); i != last; ++i, ++j) 
+			if((*i)->type_ != (*j)->type_ || (*i)->GetDisplayName() != (*j)->GetDisplayName()) return false;
+		for(i = a->subdirs_.begin(), last = a->subdirs_.end(), j = b->subdirs_.begin(); i != last; ++i, ++j) 
+			if(!SameTree(*i, *j)) return false;
+		return true;
+	}
+	//forgets the current directory's node, it is kept while the threads execute the commands
+	void ResetCurDir() {if(!parallel_) curnode_ = 0;}
+	//the index if it has been built (the changes of the tree are indexed then)
+	inline NodeIndex *Indexed() {return index_.IsBuilt() ? &index_ : 0;}
+	//gets the index, the first query builds it from the tree and the nodes kept by the transactions' log
+	NodeIndex &GetIndex() {
+		if(index_.IsBuilt()) return index_;
+		vector<File *> roots(1, &root_);
+		for(size_t i = 0; i < log_.size(); ++i) {
+			if(log_[i].node) roots.push_back(log_[i].node);
+			if(log_[i].other) roots.push_back(log_[i].other);
+		}
+		index_.Build(roots);
+		return index_;
+	}
+	//resolves the directory of a query (the root for the empty path)
+	File* QueryDir(string_view path) {
+		if(path.empty() || IsRootPath(path)) return &root_;
+		string_view name;
+		File *dir = ResolveParent(path, name);
+		return dir ? dir->HasDir(name) : 0;
+	}
 	File root_; 
 	string curdir_;
+	//cached node of the current directory (0 if not resolved yet)
+	File *curnode_;
+	//hard and dynamic links by their targets
+	LinkIndex hlinks_, dlinks_;
+	//the commands are being executed by the threads
+	bool parallel_;
+	//log of the transactions' changes, the positions where the transactions begin
+	UndoLog log_;
+	vector<Mark> marks_;
+	//journal of the executed commands, the commands of the transactions wait for the commit
+	ofstream journal_;
+	string journalPath_, pending_;
+	//message of the last failed command
+	string error_;
+	//messages of the commands failed in the continue mode
+	vector<string> errors_;
+	//counters of the instrumentation
+	Stats stats_;
+	//index of the names and the counts for the queries
+	NodeIndex index_;
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,148 @@
+#ifndef IO_UTILS
+#define IO_UTILS
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//Reading of the input files and the snapshots shared by UnitConverter and FileManagerEmulator
+
+//Reads a file by large blocks and splits it into lines without copying them,
+//so no heap allocation is done per line (a CR before the line break is dropped)
+class LineReader {
+public:
+	explicit LineReader(const std::string &path, std::size_t block = 1 << 20) : 
+		ifs_(path.c_str(), std::ios::binary), buf_(block), begin_(0), end_(0), eof_(false) {}
+
+	//Check if the file has been opened successfully
+	bool IsOpen() const {return ifs_.is_open();}
+
+	//Get the next line without the line break, the line is valid up to the next call
+	bool GetLine(std::string_view &line) {
+		for(;;) {
+			const char *b = buf_.data() + begin_, *e = buf_.data() + end_;
+			const char *nl = static_cast<const char *>(std::memchr(b, '\n', e - b));
+			if(nl || (eof_ && b != e)) {
+				if(!nl) nl = e;
+				line = std::string_view(b, nl - b);
+				if(!line.empty() && line.back() == '\r') line.remove_suffix(1);
+				begin_ = nl == e ? end_ : nl - buf_.data() + 1;
+				return true;
+			}
+			if(eof_) return false;
+			//move the incomplete line to the front and grow the buffer if the line doesn't fit
+			end_ -= begin_;
+			std::memmove(buf_.data(), b, end_);
+			begin_ = 0;
+			if(end_ == buf_.size()) buf_.resize(2 * buf_.size());
+			ifs_.read(buf_.data() + end_, buf_.size() - end_);
+			end_ += static_cast<std::size_t>(ifs_.gcount());
+			eof_ = !ifs_;
+		}
+	}
+private:
+	std::ifstream ifs_;
+	std::vector<char> buf_;
+	std::size_t begin_, end_;
+	bool eof_;
+};
+
+//Initial value of the snapshot checksum (the FNV-1a offset basis) and the byte order mark of the snapshots
+const std::uint64_t SnapshotChecksumSeed = 14695981039346656037ULL;
+const std::uint32_t SnapshotByteOrder = 0x01020304;
+
+//Sequential writer of the flat arrays a snapshot consists of, each array is padded
+//to 8 bytes and the checksum of all the written data is calculated on the fly
+//(FNV-1a over 64-bit words)
+class SnapshotWriter {
+public:
+	explicit SnapshotWriter(std::ostream &os) : os_(os), hash_(SnapshotChecksumSeed) {}
+
+	template<class T> void Put(const T *p, std::size_t n) {
+		const char *data = reinterpret_cast<const char *>(p);
+		std::size_t bytes = n * sizeof(T), full = bytes - bytes % 8;
+		os_.write(data, full);
+		hash_ = Checksum(hash_, data, full);
+		if(full == bytes) return;
+		//the last incomplete word is padded with zeros
+		char tail[8] = {0};
+		std::memcpy(tail, data + full, bytes - full);
+		os_.write(tail, 8);
+		hash_ = Checksum(hash_, tail, 8);
+	}
+	template<class T> void Put(const std::vector<T> &v) {Put(v.data(), v.size());}
+	std::uint64_t GetChecksum() const {return hash_;}
+
+	static std::uint64_t Checksum(std::uint64_t h, const char *p, std::size_t n) {
+		std::uint64_t w;
+		for(; 8 <= n; p += 8, n -= 8) {
+			std::memcpy(&w, p, 8);
+			h = (h ^ w) * 1099511628211ULL;
+		}
+		for(; n; ++p, --n) h = (h ^ static_cast<unsigned char>(*p)) * 1099511628211ULL;
+		return h;
+	}
+private:
+	std::ostream &os_;
+	std::uint64_t hash_;
+};
+//Sequential reader of the snapshot's flat arrays, reading past the end fails
+class SnapshotReader {
+public:
+	SnapshotReader(const char *p, const char *end) : p_(p), end_(end) {}
+
+	template<class T> bool Get(T *dst, std::size_t n) {
+		if(static_cast<std::size_t>(end_ - p_) / sizeof(T) < n) return false;
+		std::memcpy(dst, p_, n * sizeof(T));
+		return Skip(n * sizeof(T));
+	}
+	template<class T> bool Get(std::vector<T> &v, std::size_t n) {
+		if(static_cast<std::size_t>(end_ - p_) / sizeof(T) < n) return false;
+		v.resize(n);
+		return n ? Get(v.data(), n) : true;
+	}
+	//Get the next n characters without copying them
+	bool Get(std::string_view &s, std::size_t n) {
+		if(static_cast<std::size_t>(end_ - p_) < n) return false;
+		s = std::string_view(p_, n);
+		return Skip(n);
+	}
+private:
+	const char *p_, *end_;
+
+	//Move past n bytes of data and the padding after them
+	bool Skip(std::size_t n) {
+		n += (8 - n % 8) % 8;
+		if(static_cast<std::size_t>(end_ - p_) < n) return false;
+		p_ += n;
+		return true;
+	}
+};
+
+//Read a whole snapshot file with a single read, false is returned if the file cannot be read
+//(a directory can be opened, but it has no size, -1 or a bogus end position, and nothing can be read)
+inline bool ReadSnapshotFile(const std::string &path, std::vector<char> &buf) {
+	std::ifstream ifs(path.c_str(), std::ios::binary | std::ios::ate);
+	std::streamoff size = ifs.tellg();
+	ifs.seekg(0);
+	if(ifs.fail() || size < 0 || (size && ifs.peek() == std::ifstream::traits_type::eof())) return false;
+	buf.resize(static_cast<std::size_t>(size));
+	ifs.read(buf.data(), buf.size());
+	return !ifs.fail();
+}
+//Copy the header of the snapshot read into the buffer, false is returned if it is not a snapshot
+//with the magic (up to 8 characters) and the version of this byte order or the checksum of the data
+//following the header differs (the header starts with the magic, the version and the byte order)
+template<class Header> bool ReadSnapshotHeader(const std::vector<char> &buf, const char *magic, std::uint32_t version, Header &h) {
+	if(buf.size() < sizeof(h)) return false;
+	std::memcpy(&h, buf.data(), sizeof(h));
+	return !std::strncmp(h.magic, magic, sizeof(h.magic)) && h.version == version && h.byteOrder == SnapshotByteOrder &&
+	       h.checksum == SnapshotWriter::Checksum(SnapshotChecksumSeed, buf.data() + sizeof(h), buf.size() - sizeof(h));
+}
+
+#endif
\ No newline at end of file
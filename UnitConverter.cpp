@@ -1,13 +1,42 @@
 #include "UnitConverter.h"
 
 int main(int argc, char* argv[]) {
-	if (3 == argc) {
+	bool stream = false, verbose = false;
+	unsigned threads = 1;
+	std::string load, save;
+	int i = 1;
+	for(; i < argc && argv[i][0] == '-'; ++i) {
+		std::string opt(argv[i]);
+		if(opt == "-s") stream = true;
+		else if(opt == "-v") verbose = true;
+		else if(opt == "-j" && i + 1 < argc) threads = static_cast<unsigned>(atoi(argv[++i]));
+		else if(opt == "-l" && i + 1 < argc) load = argv[++i];
+		else if(opt == "-w" && i + 1 < argc) save = argv[++i];
+		else break;
+	}
+	if (2 == argc - i) {
 		UnitConverter uconv;
-		uconv.ReadInput(argv[1]);
-		uconv.MakeOutput(argv[2]);
+		if(stream) {
+			uconv.Convert(argv[i], argv[i + 1]);
+			if(verbose)
+				std::cout << "Path cache: " << uconv.GetCacheStats().hits << " hits, " 
+				          << uconv.GetCacheStats().misses << " misses\n";
+		}
+		else {
+			if(!load.empty() && !uconv.LoadSnapshot(load))
+				UnitConverter::ErrorMsg("Cannot load the " + load + " snapshot, the program will terminate.");
+			uconv.ReadInput(argv[i], !load.empty());
+			if(!save.empty()) uconv.SaveSnapshot(save);
+			uconv.MakeOutput(argv[i + 1], threads);
+		}
 	}
 	else {
-		std::cout << "Usage: UnitConverter.exe input_file_path output_file_path\n";
+		std::cout << "Usage: UnitConverter.exe [-s [-v]] [-j threads] [-l snapshot] [-w snapshot] input_file_path output_file_path\n"
+		             "  -s  convert the requests while streaming the input (rules should precede them)\n"
+		             "  -v  print the path cache statistics after streaming\n"
+		             "  -j  number of threads converting the requests (0 - one per core, default 1)\n"
+		             "  -l  load the rules from a snapshot before reading the input\n"
+		             "  -w  save the loaded rules into a snapshot after reading the input\n";
 		system("pause");
 	}
 	return EXIT_SUCCESS;
@@ -4,156 +4,844 @@
 #include <iostream>
 #include <ios>
 #include <cassert>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <charconv>
+#include <limits>
 #include <algorithm>
-#include <iomanip>
-#include <sstream>
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <map>
+#include <unordered_map>
+#include <utility>
+#include <thread>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include "IOUtils.h"
 
 class UnitConverter {    
-	//All variables(units) are held in directed graph's adjacency matrix, 
-	//each a[i][j] element represents the ratio(weight) of i-th and j-th variable,
+	//All variables(units) are held in directed graph's adjacency lists,
+	//each (j, a[i][j]) edge of the i-th list represents the ratio(weight) of i-th and j-th variable,
 	//thus this can be used when constructing the conversion chain of 
 	//2 not explicitly related variables by calculating the multiplication
 	//of all ratio values obtained from the path between 2 given vertices,
 	//(path search algorithm between any 2 given vertices of a directed graph is used).
+	//Only the arcs defined by conversion rules are stored, so memory scales with the rules count.
+	//The graph is public to let the benchmarks drive it directly.
+	public:
 	class Digraph {
 	public:
 		typedef std::size_t Vertex;
 		typedef std::vector<Vertex> Path;
+
+		//outgoing arc of a vertex, lists are kept sorted by the target vertex
+		struct Edge {
+			Vertex to;
+			double weight;
+			Edge(Vertex v, double w) : to(v), weight(w) {}
+			Edge() : to(0), weight(0.0) {}
+		};
+		typedef std::vector<Edge> Edges;
 		
 		//Set/Get functions for weight value of arc from i-th to j-th vertex
 		void SetWeight(Digraph::Vertex v1, Digraph::Vertex v2, double val) {
-			assert(v1 < weights_.size() && v2 < weights_.size() && 0.0 < val);
-			weights_[v1][v2] = val;
+			assert(v1 < edges_.size() && v2 < edges_.size() && 0.0 < val);
+			if(!PutArc(v1, v2, val)) return;
+			indexed_ = false;
+			cache_.clear();
 		}
 		double GetWeight(Digraph::Vertex v1, Digraph::Vertex v2) const {
-			assert(v1 < weights_.size() && v2 < weights_.size());
-			return weights_[v1][v2];
+			assert(v1 < edges_.size() && v2 < edges_.size());
+			const Edges &e = edges_[v1];
+			Edges::const_iterator i = FindEdge(e, v2);
+			if(i != e.end() && i->to == v2) return i->weight;
+			return v1 == v2 ? 1.0 : -1.0;
+		}
+
+		//Set the ratio of 2 vertices (the arcs in both directions) keeping the index up to date:
+		//when 2 components get joined the smaller one is rescaled and merged into the larger one,
+		//a changed ratio inside of a component relabels just that component
+		void SetRatio(Digraph::Vertex v1, Digraph::Vertex v2, double val) {
+			assert(v1 < edges_.size() && v2 < edges_.size() && 0.0 < val);
+			if(!indexed_) {
+				SetWeight(v1, v2, val);
+				SetWeight(v2, v1, 1.0 / val);
+				return;
+			}
+			Vertex c1 = comp_[v1], c2 = comp_[v2];
+			bool changed = PutArc(v1, v2, val);
+			if(PutArc(v2, v1, 1.0 / val)) changed = true;
+			if(!changed) return;
+			EraseCached(c1, c2);
+			if(c1 == c2) Relabel(c1);
+			else if(size_[c1] < size_[c2]) Merge(v1, factor_[v2] / val / factor_[v1], c2);
+			else Merge(v2, factor_[v1] * val / factor_[v2], c1);
+		}
+		//Remove the arcs between 2 vertices keeping the index up to date,
+		//the component is relabeled and gets split if the vertices aren't connected anymore
+		bool RemoveRatio(Digraph::Vertex v1, Digraph::Vertex v2) {
+			assert(v1 < edges_.size() && v2 < edges_.size());
+			bool removed = EraseArc(v1, v2);
+			if(EraseArc(v2, v1)) removed = true;
+			if(!removed) return false;
+			if(!indexed_) {
+				cache_.clear();
+				return true;
+			}
+			Vertex c = comp_[v1];
+			EraseCached(c, c);
+			//the part not reached from the new root keeps the old label, so it must differ from it
+			if(c == v1) std::swap(v1, v2);
+			Relabel(v1);
+			if(comp_[v2] != v1) Relabel(v2);
+			return true;
 		}
 
-		//Add a vertex to the graph
+		//Add a vertex to the graph (the index stays up to date, the vertex is a component itself)
 		void AddVertex() {
-			std::size_t i, n;
-			weights_.push_back(std::vector<double>(weights_.size() + 1));
-			for(i = 0, n = weights_.size() - 1; i < n; weights_[i].push_back(-1.0), ++i);
-			for(i = 0, n = weights_.size(); i < n; weights_[n - 1][i] = -1.0, weights_[i][i] = 1.0, ++i);
+			edges_.push_back(Edges());
+			if(!indexed_) return;
+			comp_.push_back(edges_.size() - 1);
+			factor_.push_back(1.0);
+			size_.push_back(1);
 		}
 
+		//Check if there are arcs going out of the vertex
+		bool HasArcs(Digraph::Vertex v) const {assert(v < edges_.size()); return !edges_[v].empty();}
+
+		//Get the arcs going out of the vertex
+		const Edges &GetArcs(Digraph::Vertex v) const {assert(v < edges_.size()); return edges_[v];}
+
 		//Get number of vertices in a graph
-		size_t GetVertexCount() const {return weights_.size();}
+		size_t GetVertexCount() const {return edges_.size();}
 
 		//Erase the graph
-		void MakeEmpty() {weights_.clear();}
+		void MakeEmpty() {edges_.clear(); comp_.clear(); factor_.clear(); size_.clear(); cache_.clear(); indexed_ = false;}
 
-		//Get the sequence of vertices (the path) if a path exists form i-th to j-th vertex
+		//Get the sequence of vertices (the path with fewest arcs) if a path exists form i-th to j-th vertex
 		bool GetPath(Digraph::Vertex v1, Digraph::Vertex v2, Digraph::Path &path) {
-			assert(v1 < weights_.size() && v2 < weights_.size());
-			FindPath(v1, v2, path);
+			assert(v1 < edges_.size() && v2 < edges_.size());
+			path.clear();
+			return FindPath(v1, v2, path);
+		}
 
-			return  (!path.empty()) && path[0] == v1 && path[path.size() - 1] == v2;
+		//Get the weight of i-th to j-th conversion by multiplying the weights along the path,
+		//the results are memoized per pair of vertices until the arcs of the graph change
+		bool GetPathFactor(Digraph::Vertex v1, Digraph::Vertex v2, double &f) {
+			assert(v1 < edges_.size() && v2 < edges_.size() && edges_.size() <= 0xffffffffULL);
+			std::uint64_t key = static_cast<std::uint64_t>(v1) << 32 | v2;
+			Cache::const_iterator it = cache_.find(key);
+			if(it != cache_.end()) {
+				++stats_.hits;
+				f = it->second;
+				return 0.0 < f;
+			}
+			++stats_.misses;
+			Path path;
+			f = -1.0;
+			if(GetPath(v1, v2, path)) {
+				f = 1.0;
+				for(size_t i = 0, n = path.size() - 1; i < n; f *= GetWeight(path[i], path[i + 1]), ++i);
+			}
+			if(MaxCacheSize <= cache_.size()) cache_.clear();
+			cache_[key] = f;
+			return 0.0 < f;
 		}
+		//Hit/miss counters of the path factors cache
+		struct CacheStats {
+			std::size_t hits, misses;
+			CacheStats() : hits(0), misses(0) {}
+		};
+		const CacheStats &GetCacheStats() const {return stats_;}
+
+		//Build the conversion index: since arcs hold ratios, each connected component is labeled
+		//by BFS and every vertex gets its factor relative to the component's root vertex,
+		//thus the weight of any i-th to j-th conversion is factor[j] / factor[i]
+		void BuildIndex() {
+			comp_.assign(edges_.size(), NoComponent);
+			factor_.assign(edges_.size(), 0.0);
+			size_.assign(edges_.size(), 0);
+			for(Vertex r = 0, n = edges_.size(); r < n; ++r)
+				if(comp_[r] == NoComponent) Relabel(r);
+			indexed_ = true;
+		}
+		//Check if the index is up to date with the arcs of the graph
+		bool IsIndexed() const {return indexed_;}
+
+		//Get the weight of i-th to j-th conversion from the index, if both vertices are connected
+		bool GetFactor(Digraph::Vertex v1, Digraph::Vertex v2, double &f) const {
+			assert(indexed_ && v1 < comp_.size() && v2 < comp_.size());
+			if(comp_[v1] != comp_[v2]) return false;
+			f = factor_[v2] / factor_[v1];
+			return true;
+		}
+
+		//Write the arcs (as compressed rows) and the index into a snapshot
+		void Save(SnapshotWriter &w) const {
+			std::vector<std::uint64_t> offsets(1, 0);
+			for(AdjLists::const_iterator i = edges_.begin(), last = edges_.end(); i != last; ++i)
+				offsets.push_back(offsets.back() + i->size());
+			w.Put(offsets);
+			for(AdjLists::const_iterator i = edges_.begin(), last = edges_.end(); i != last; ++i)
+				w.Put(*i);
+			if(!indexed_) return;
+			w.Put(comp_);
+			w.Put(factor_);
+			w.Put(size_);
+		}
+		//Read n vertices' arcs and the index (if it has been saved) from a snapshot,
+		//false is returned if the data is inconsistent
+		bool Load(SnapshotReader &r, std::size_t n, bool indexed) {
+			std::vector<std::uint64_t> offsets;
+			MakeEmpty();
+			if(!r.Get(offsets, n + 1) || offsets[0] != 0) return false;
+			edges_.resize(n);
+			for(Vertex v = 0; v < n; ++v) {
+				if(offsets[v + 1] < offsets[v] || !r.Get(edges_[v], offsets[v + 1] - offsets[v])) return false;
+				for(Edges::const_iterator i = edges_[v].begin(), last = edges_[v].end(); i != last; ++i)
+					if(n <= i->to || !(0.0 < i->weight) || (i != edges_[v].begin() && i->to <= (i - 1)->to)) return false;
+			}
+			if(!indexed) return true;
+			if(!r.Get(comp_, n) || !r.Get(factor_, n) || !r.Get(size_, n)) return false;
+			for(Vertex v = 0; v < n; ++v)
+				if(n <= comp_[v] || !(0.0 < factor_[v])) return false;
+			indexed_ = true;
+			return true;
+		}
+
+		Digraph() : indexed_(false) {}
 	private:
-		typedef std::vector<std::vector<double> > AdjMatrix;
-		AdjMatrix weights_;
+		struct EdgeCmp {
+			bool operator()(const Edge &lhs, Vertex rhs) const {return lhs.to < rhs;}
+		};
+		typedef std::vector<Edges> AdjLists;
+		static constexpr Vertex NoComponent = static_cast<Vertex>(-1);
+		//the cache is dropped entirely once it reaches this size
+		static const std::size_t MaxCacheSize = 1 << 20;
+		typedef std::unordered_map<std::uint64_t, double> Cache;
+		AdjLists edges_;
+		//component's root vertex and the factor relative to it for each vertex
+		std::vector<Vertex> comp_;
+		std::vector<double> factor_;
+		//number of vertices in the component, valid for the root vertices only
+		std::vector<std::size_t> size_;
+		bool indexed_;
+		//memoized path factors keyed by the pair of vertices, negative if there is no path
+		Cache cache_;
+		CacheStats stats_;
+		//scratch buffers of the path search reused between the calls:
+		//visited vertices bitset, BFS queue and the predecessor of each visited vertex
+		std::vector<std::uint64_t> visited_;
+		Path queue_, prev_;
+
+		//Returns the position of arc to v (or the position it should be inserted at),
+		//new units get increasing ids, so insertions are appends in the common case
+		static Edges::iterator FindEdge(Edges &e, Vertex v) {
+			if(e.empty() || e.back().to < v) return e.end();
+			return std::lower_bound(e.begin(), e.end(), v, EdgeCmp());
+		}
+		static Edges::const_iterator FindEdge(const Edges &e, Vertex v) {
+			if(e.empty() || e.back().to < v) return e.end();
+			return std::lower_bound(e.begin(), e.end(), v, EdgeCmp());
+		}
 
-		//Path finding utility which should be called from the main GetPath public member
+		//Set the weight of an arc, returns false if the arc already has that weight
+		bool PutArc(Vertex v1, Vertex v2, double val) {
+			Edges &e = edges_[v1];
+			Edges::iterator i = FindEdge(e, v2);
+			if(i != e.end() && i->to == v2) {
+				if(i->weight == val) return false;
+				i->weight = val;
+			}
+			else e.insert(i, Edge(v2, val));
+			return true;
+		}
+		//Remove an arc, returns false if there is no such arc
+		bool EraseArc(Vertex v1, Vertex v2) {
+			Edges &e = edges_[v1];
+			Edges::iterator i = FindEdge(e, v2);
+			if(i == e.end() || i->to != v2) return false;
+			e.erase(i);
+			return true;
+		}
+
+		//Label the component of the vertex by BFS making the vertex its root
+		void Relabel(Vertex r) {
+			visited_.resize((edges_.size() + 63) / 64);
+			queue_.assign(1, r);
+			visited_[r / 64] |= 1ULL << (r % 64);
+			comp_[r] = r;
+			factor_[r] = 1.0;
+			for(size_t head = 0; head < queue_.size(); ++head) {
+				Vertex v = queue_[head];
+				for(Edges::const_iterator i = edges_[v].begin(), last = edges_[v].end(); i != last; ++i) {
+					std::uint64_t &bits = visited_[i->to / 64], bit = 1ULL << (i->to % 64);
+					if(bits & bit) continue;
+					bits |= bit;
+					comp_[i->to] = r;
+					factor_[i->to] = factor_[v] * i->weight;
+					queue_.push_back(i->to);
+				}
+			}
+			size_[r] = queue_.size();
+			for(Path::const_iterator i = queue_.begin(), last = queue_.end(); i != last; ++i)
+				visited_[*i / 64] &= ~(1ULL << (*i % 64));
+		}
+		//Move the component of the vertex into the component with the given root,
+		//the factors of the moved vertices are multiplied by scale
+		void Merge(Vertex v, double scale, Vertex root) {
+			Vertex old = comp_[v];
+			queue_.assign(1, v);
+			comp_[v] = root;
+			factor_[v] *= scale;
+			for(size_t head = 0; head < queue_.size(); ++head) {
+				Vertex u = queue_[head];
+				for(Edges::const_iterator i = edges_[u].begin(), last = edges_[u].end(); i != last; ++i)
+					if(comp_[i->to] == old) {
+						comp_[i->to] = root;
+						factor_[i->to] *= scale;
+						queue_.push_back(i->to);
+					}
+			}
+			size_[root] += queue_.size();
+		}
+		//Erase the cached path factors of the vertex pairs lying in c1 and c2 components
+		void EraseCached(Vertex c1, Vertex c2) {
+			for(Cache::iterator i = cache_.begin(); i != cache_.end(); ) {
+				Vertex a = comp_[i->first >> 32], b = comp_[i->first & 0xffffffffULL];
+				if((a == c1 && b == c2) || (a == c2 && b == c1)) i = cache_.erase(i);
+				else ++i;
+			}
+		}
+
+		//Path finding utility which should be called from the main GetPath public member,
+		//iterative BFS, so the found path has the fewest arcs (and accumulates the least rounding error)
 		bool FindPath(Vertex v1, Vertex v2, Path &path) {
+			bool found = v1 == v2;
+			visited_.resize((edges_.size() + 63) / 64);
+			prev_.resize(edges_.size());
+			queue_.assign(1, v1);
+			visited_[v1 / 64] |= 1ULL << (v1 % 64);
+			for(size_t head = 0; !found && head < queue_.size(); ++head) {
+				Vertex v = queue_[head];
+				for(Edges::const_iterator i = edges_[v].begin(), last = edges_[v].end(); i != last; ++i) {
+					std::uint64_t &bits = visited_[i->to / 64], bit = 1ULL << (i->to % 64);
+					if(bits & bit) continue;
+					bits |= bit;
+					prev_[i->to] = v;
+					queue_.push_back(i->to);
+					if(i->to == v2) {found = true; break;}
+				}
+			}
+			//only the visited bits are reset, so the cost doesn't depend on the graph size
+			for(Path::const_iterator i = queue_.begin(), last = queue_.end(); i != last; ++i)
+				visited_[*i / 64] &= ~(1ULL << (*i % 64));
+			if(!found) return false;
+
+			size_t first = path.size();
+			for(Vertex v = v2; v != v1; v = prev_[v]) path.push_back(v);
 			path.push_back(v1);
-			if(v1 == v2) return true;
-			for(Vertex v = 0, last = weights_.size(); v < last; ++v)
-				if(v1 != v && weights_[v1][v] > 0.0 && find(path.begin(), path.end(), v) == path.end() && FindPath(v, v2, path))
-					return true;
-			return false;
+			std::reverse(path.begin() + first, path.end());
+			return true;
+		}
+	};
+	private:
+	//Interning table of unit names, each unit gets a stable id (its index of insertion)
+	//which is also used as its vertex in the graph. Lookups are done by open addressing
+	//with linear probing, so unknown units can be queried without modifying the table.
+	class UnitTable {
+	public:
+		typedef std::size_t Id;
+		static constexpr Id NoId = static_cast<Id>(-1);
+
+		//Get the id of a unit, NoId is returned if the unit is unknown
+		Id Find(std::string_view name) const {
+			if(slots_.empty()) return NoId;
+			std::size_t h = Hash(name), mask = slots_.size() - 1;
+			for(std::size_t i = h & mask; slots_[i] != NoId; i = (i + 1) & mask)
+				if(hashes_[slots_[i]] == h && names_[slots_[i]] == name) return slots_[i];
+			return NoId;
+		}
+		//Get the id of a unit, the unit is added if it is unknown
+		Id Intern(std::string_view name) {
+			if(slots_.size() <= 2 * names_.size()) Rehash(slots_.empty() ? 64 : 2 * slots_.size());
+			std::size_t h = Hash(name), mask = slots_.size() - 1, i;
+			for(i = h & mask; slots_[i] != NoId; i = (i + 1) & mask)
+				if(hashes_[slots_[i]] == h && names_[slots_[i]] == name) return slots_[i];
+			slots_[i] = names_.size();
+			names_.push_back(std::string(name));
+			hashes_.push_back(h);
+			return slots_[i];
+		}
+		//Get the name of a unit by its id
+		const std::string &GetName(Id id) const {assert(id < names_.size()); return names_[id];}
+
+		//Get number of units in the table
+		size_t GetCount() const {return names_.size();}
+
+		//Erase the table
+		void MakeEmpty() {names_.clear(); hashes_.clear(); slots_.clear();}
+
+		//Get number of the hash slots
+		size_t GetSlotCount() const {return slots_.size();}
+
+		//Write the names (as offsets and characters), their hashes and the slots into a snapshot
+		void Save(SnapshotWriter &w) const {
+			std::vector<std::uint64_t> offsets(1, 0);
+			std::string chars;
+			for(std::vector<std::string>::const_iterator i = names_.begin(), last = names_.end(); i != last; ++i) {
+				offsets.push_back(offsets.back() + i->size());
+				chars += *i;
+			}
+			w.Put(offsets);
+			w.Put(chars.data(), chars.size());
+			w.Put(hashes_);
+			w.Put(slots_);
+		}
+		//Read n names and the given number of slots from a snapshot, so no rehashing is needed,
+		//false is returned if the data is inconsistent
+		bool Load(SnapshotReader &r, std::size_t n, std::size_t slots) {
+			std::vector<std::uint64_t> offsets;
+			std::string_view chars;
+			MakeEmpty();
+			if(!r.Get(offsets, n + 1) || offsets[0] != 0 || !r.Get(chars, offsets[n])) return false;
+			names_.reserve(n);
+			for(Id id = 0; id < n; ++id) {
+				if(offsets[id + 1] < offsets[id]) return false;
+				names_.push_back(std::string(chars.substr(offsets[id], offsets[id + 1] - offsets[id])));
+			}
+			if(!r.Get(hashes_, n) || (slots & (slots - 1)) || slots < 2 * n || !r.Get(slots_, slots)) return false;
+			for(std::vector<Id>::const_iterator i = slots_.begin(), last = slots_.end(); i != last; ++i)
+				if(*i != NoId && n <= *i) return false;
+			return true;
+		}
+	private:
+		std::vector<std::string> names_;
+		std::vector<std::size_t> hashes_;
+		std::vector<Id> slots_;
+
+		//FNV-1a hash of a unit name
+		static std::size_t Hash(std::string_view s) {
+			std::uint64_t h = 14695981039346656037ULL;
+			for(std::string_view::const_iterator i = s.begin(), last = s.end(); i != last; ++i)
+				h = (h ^ static_cast<unsigned char>(*i)) * 1099511628211ULL;
+			return static_cast<std::size_t>(h);
 		}
+		//Grow the slots (size is kept a power of 2) and reinsert all ids
+		void Rehash(std::size_t n) {
+			std::size_t mask = n - 1, i;
+			slots_.assign(n, NoId);
+			for(Id id = 0, last = names_.size(); id < last; ++id) {
+				for(i = hashes_[id] & mask; slots_[i] != NoId; i = (i + 1) & mask);
+				slots_[i] = id;
+			}
+		}
+	};
+	//Collects the output in a large reusable buffer and writes it to the stream by big blocks,
+	//without a stream the buffer just grows and keeps all the output
+	class OutputBuffer {
+	public:
+		explicit OutputBuffer(std::ostream *os = 0, std::size_t block = 1 << 20) : os_(os), buf_(block), size_(0) {}
+		~OutputBuffer() {Flush();}
+
+		void Append(std::string_view s) {
+			Reserve(s.size());
+			std::memcpy(buf_.data() + size_, s.data(), s.size());
+			size_ += s.size();
+		}
+		void Append(char c) {Reserve(1); buf_[size_++] = c;}
+
+		//Append a number with 6 significant digits, the scientific notation is used
+		//for the nonzero numbers whose magnitude is out of [0.1, 1000000) range
+		//(trailing zeros are dropped as %g does)
+		void AppendNumber(double d) {
+			Reserve(MaxNumberLength);
+			char *first = buf_.data() + size_, *last;
+			double a = std::fabs(d);
+			if(d != 0.0 && (1000000.0 <= a || a < 0.1)) {
+				last = std::to_chars(first, first + MaxNumberLength, d, std::chars_format::scientific, 5).ptr;
+				char *exp = std::find(first, last, 'e'), *p = exp;
+				for(; p[-1] == '0'; --p);
+				if(p[-1] == '.') --p;
+				last = std::copy(exp, last, p);
+			}
+			else last = std::to_chars(first, first + MaxNumberLength, d, std::chars_format::general, 6).ptr;
+			size_ = last - buf_.data();
+		}
+
+		//Write the collected data to the stream
+		void Flush() {
+			if(!os_) return;
+			if(size_) os_->write(buf_.data(), size_);
+			size_ = 0;
+		}
+		//Get the collected (not flushed yet) data
+		std::string_view GetData() const {return std::string_view(buf_.data(), size_);}
+	private:
+		static const std::size_t MaxNumberLength = 32;
+		std::ostream *os_;
+		std::vector<char> buf_;
+		std::size_t size_;
+
+		//Make room for n more characters, flushing or growing the buffer
+		void Reserve(std::size_t n) {
+			if(n <= buf_.size() - size_) return;
+			Flush();
+			if(buf_.size() - size_ < n) buf_.resize(std::max(2 * buf_.size(), size_ + n));
+		}
+	};
+	//Conversion request, parsed once while reading the input
+	struct Request {
+		double value;
+		Digraph::Vertex from, to;
 	};
-	typedef std::vector<std::string> Units;
-	typedef std::map<std::string, Digraph::Vertex> IdMap;
+	typedef std::vector<Request> Requests;
+	//Header of a snapshot file, the arrays of the units table and of the graph follow it
+	struct SnapshotHeader {
+		char magic[8];
+		std::uint32_t version, byteOrder, wordSize, indexed;
+		std::uint64_t units, slots, checksum;
+	};
+	static const std::uint32_t SnapshotVersion = 1;
+	//requests count below which spawning one more thread doesn't pay off
+	static const std::size_t MinRequestsPerThread = 4096;
     
-	Units units_, convreq_;
+	UnitTable units_;
+	Requests convreq_;
 	Digraph digraph_;
-	IdMap idmap_;
+
+	//Get the vertex of a unit, new units are added to the graph as well
+	Digraph::Vertex AddUnit(std::string_view name) {
+		UnitTable::Id id = units_.Intern(name);
+		if(id == digraph_.GetVertexCount()) digraph_.AddVertex();
+		return id;
+	}
+	//Split a line into whitespace separated tokens, returns the number of tokens found (n at most)
+	static std::size_t Tokenize(std::string_view line, std::string_view *tokens, std::size_t n) {
+		std::size_t cnt = 0, i = 0, j, len = line.size();
+		while(cnt < n) {
+			for(; i < len && std::isspace(static_cast<unsigned char>(line[i])); ++i);
+			if(i == len) break;
+			for(j = i; j < len && !std::isspace(static_cast<unsigned char>(line[j])); ++j);
+			tokens[cnt++] = line.substr(i, j - i);
+			i = j;
+		}
+		return cnt;
+	}
+	//Parse a decimal number, the whole token should be consumed
+	static bool ParseNumber(std::string_view s, double &d) {
+		if(!s.empty() && s[0] == '+') s.remove_prefix(1);
+		std::from_chars_result r = std::from_chars(s.data(), s.data() + s.size(), d);
+		return r.ec == std::errc() && r.ptr == s.data() + s.size();
+	}
+	//Parse a line of the input file: a conversion rule is applied to the graph immediately,
+	//a conversion request is stored in req and true is returned; the units of a request are only
+	//looked up (NoId if unknown, so they don't grow the table and the graph), their names are left in units
+	bool ParseLine(std::string_view line, Request &req, std::string_view *units) {
+		std::string_view t[5];
+		double d1, d2;
+		if(Tokenize(line, t, 5) < 5) return false;
+		if(t[3] == "?") {
+			units[0] = t[1];
+			units[1] = t[4];
+			req.from = units_.Find(t[1]);
+			req.to = units_.Find(t[4]);
+			if(!ParseNumber(t[0], req.value)) req.value = std::numeric_limits<double>::quiet_NaN();
+			return true;
+		}
+		if(!ParseNumber(t[0], d1) || !ParseNumber(t[3], d2) || !(0.0 < d1) || !(0.0 < d2)) return false;
+		Digraph::Vertex rid1 = AddUnit(t[1]);
+		Digraph::Vertex rid2 = AddUnit(t[4]);
+		digraph_.SetWeight(rid1, rid2, d2/d1);
+		digraph_.SetWeight(rid2, rid1, d1/d2);
+		return false;
+	}
+	//Check if the request has a valid value and both its units are defined by rules
+	//(units met only in requests are not in the table, units of the removed rules have no arcs)
+	bool IsValid(const Request &req) const {
+		return req.value == req.value && req.from != UnitTable::NoId && req.to != UnitTable::NoId &&
+		       digraph_.HasArcs(req.from) && digraph_.HasArcs(req.to);
+	}
+	//Write the result of a conversion request from the index (the index should be up to date)
+	void WriteResult(OutputBuffer &out, const Request &req) const {
+		double f;
+		WriteResult(out, req, IsValid(req) && digraph_.GetFactor(req.from, req.to, f) ? &f : 0);
+	}
+	//Write the result of a conversion request, f is the conversion factor (0 if no conversion is possible)
+	void WriteResult(OutputBuffer &out, const Request &req, const double *f) const {
+		if(!f) out.Append("No conversion is possible.\n");
+		else {
+			out.AppendNumber(req.value);
+			out.Append(' ');
+			out.Append(units_.GetName(req.from));
+			out.Append(" = ");
+			out.AppendNumber(req.value * *f);
+			out.Append(' ');
+			out.Append(units_.GetName(req.to));
+			out.Append('\n');
+		}
+	}
 	public:
-		//Read up an input file containing conversion rules and chains need to be converted
-		void ReadInput(const std::string &inFile) {
-			int cnt = 0;
-			double d1, d2;
-			std::stringstream ss;
-			digraph_.MakeEmpty();
-			
-			std::ifstream ifs(inFile.c_str());
-			if(ifs.fail()) {
-				std::cout << "Cannot open the " << inFile << " file, the program will terminate." << std::endl;
-				std::system("pause");
-				exit(1);
+		//Read up an input file containing conversion rules and chains need to be converted,
+		//with append the rules are added to the already loaded ones (e.g. from a snapshot)
+		void ReadInput(const std::string &inFile, bool append = false) {
+			//the names of the units of the requests unknown when they are read, a later rule may define them
+			struct Unresolved {std::size_t request; UnitTable::Id from, to;};
+			std::vector<Unresolved> unresolved;
+			UnitTable pending;
+			Request req;
+			std::string_view s, units[2];
+			if(!append) {
+				units_.MakeEmpty();
+				digraph_.MakeEmpty();
 			}
+			convreq_.clear();
 			
-			for(std::string s, v1, u1, v2, u2, tmp; getline(ifs, s); ) {
-				ss.clear();
-				ss.str(s);
-				ss >> v1 >> u1 >> tmp >> v2 >> u2;
-				if(v2!="?") {
-					Units::const_iterator i = std::find(units_.begin(), units_.end(), u1);
-					if(i == units_.end()) {
-						units_.push_back(u1);
-						idmap_[u1] = cnt++;
-						digraph_.AddVertex();
-					}
-					i = find(units_.begin(), units_.end(), u2);
-					if(i == units_.end()) {
-						units_.push_back(u2);
-						idmap_[u2] = cnt++;
-						digraph_.AddVertex();
+			LineReader in(inFile);
+			if(!in.IsOpen())
+				ErrorMsg("Cannot open the " + inFile + " file, the program will terminate.");
+			
+			while(in.GetLine(s))
+				if(ParseLine(s, req, units)) {
+					if(req.from == UnitTable::NoId || req.to == UnitTable::NoId) {
+						Unresolved u = {convreq_.size(), pending.Intern(units[0]), pending.Intern(units[1])};
+						unresolved.push_back(u);
 					}
-					d1 = atof(v1.c_str());
-					d2 = atof(v2.c_str());
-					Digraph::Vertex &rid1 = idmap_[u1];
-					Digraph::Vertex &rid2 = idmap_[u2];
-					digraph_.SetWeight(rid1, rid2, d2/d1);
-					digraph_.SetWeight(rid2, rid1, d1/d2);
-				} 
-				else convreq_.push_back(s);
+					convreq_.push_back(req);
+				}
+			for(std::vector<Unresolved>::const_iterator i = unresolved.begin(), last = unresolved.end(); i != last; ++i) {
+				convreq_[i->request].from = units_.Find(pending.GetName(i->from));
+				convreq_[i->request].to = units_.Find(pending.GetName(i->to));
 			}
+			//the index survives if only requests have been added
+			if(!digraph_.IsIndexed()) digraph_.BuildIndex();
+		}
+
+		//Save the loaded units, rules and the conversion index into a binary snapshot file
+		void SaveSnapshot(const std::string &filePath) const {
+			std::ofstream ofs(filePath.c_str(), std::ios::binary);
+			if(ofs.fail())
+				ErrorMsg("Cannot create the " + filePath + " file, the program will terminate.");
+
+			SnapshotHeader h;
+			std::memset(&h, 0, sizeof(h));
+			std::memcpy(h.magic, "UCSNAP", 6);
+			h.version = SnapshotVersion;
+			h.byteOrder = SnapshotByteOrder;
+			h.wordSize = sizeof(std::size_t);
+			h.indexed = digraph_.IsIndexed();
+			h.units = units_.GetCount();
+			h.slots = units_.GetSlotCount();
+			ofs.write(reinterpret_cast<const char *>(&h), sizeof(h));
+
+			SnapshotWriter w(ofs);
+			units_.Save(w);
+			digraph_.Save(w);
+			h.checksum = w.GetChecksum();
+			ofs.seekp(0);
+			ofs.write(reinterpret_cast<const char *>(&h), sizeof(h));
+			if(ofs.fail())
+				ErrorMsg("Cannot write the " + filePath + " file, the program will terminate.");
 		}
+		//Load the units, rules and the conversion index from a snapshot file with a single read,
+		//false is returned (and the loaded data and requests are kept) if the file cannot be read
+		//or is not a valid snapshot of this version; the snapshot is loaded into the new table and graph,
+		//they replace the current ones only if all of it is valid
+		bool LoadSnapshot(const std::string &filePath) {
+			std::vector<char> buf;
+			SnapshotHeader h;
+			if(!ReadSnapshotFile(filePath, buf) || !ReadSnapshotHeader(buf, "UCSNAP", SnapshotVersion, h) ||
+			   h.wordSize != sizeof(std::size_t))
+				return false;
 
-		//Dump converted data into output file (conversion rules might be specified previously)
-		void MakeOutput(const std::string &filePath) {
+			SnapshotReader r(buf.data() + sizeof(h), buf.data() + buf.size());
+			UnitTable units;
+			Digraph digraph;
+			if(!units.Load(r, h.units, h.slots) || !digraph.Load(r, h.units, h.indexed != 0)) return false;
+			std::swap(units_, units);
+			std::swap(digraph_, digraph);
+			convreq_.clear();
+			return true;
+		}
+
+		//Dump converted data into output file (conversion rules might be specified previously),
+		//the requests are split between the given number of threads (0 - one per hardware thread),
+		//each thread formats its part into its own buffer and the parts are written in the original order
+		void MakeOutput(const std::string &filePath, unsigned threads = 1) {
 			std::ofstream ofs(filePath.c_str());
-			if(ofs.fail()) {
-				std::cout << "Cannot create the " << filePath << " file, the program will terminate." << std::endl;
-				system("pause");
-				exit(1);
-			}
-
-			double d, p;
-			std::stringstream ss;
-			std::string v1, u1, tmp, v2, u2;
-			ofs << std::setprecision(6);
-			for(size_t i = 0, n = convreq_.size(); i < n; ++i) {
-				Digraph::Path path;
-				ss.clear();
-				ss.str(convreq_[i]);
-				ss >> v1 >> u1 >> tmp >> v2 >> u2;
-				Digraph::Vertex &rid1 = idmap_[u1];
-				Digraph::Vertex &rid2 = idmap_[u2];
-
-				if(find(units_.begin(), units_.end(), u1) == units_.end() ||
-				   find(units_.begin(), units_.end(), u2) == units_.end() ||
-				   !digraph_.GetPath(rid1, rid2, path))
-				   ofs << "No conversion is possible." << std::endl;
-				else {
-					p = d = atof(v1.c_str());
-					if(0.0 < digraph_.GetWeight(rid1, rid2))
-						p *= digraph_.GetWeight(rid1, rid2);
-					else for(size_t j = 0, n = path.size() - 1; j < n; p *= digraph_.GetWeight(path[j], path[j + 1]), ++j);
-					if(1000000.0 <= d || d < 0.1) 
-					std::printf("%06d %06d", d, u1);
-					if(1000000.0 <= p || p < 0.1) 
-					std::printf("%06d %06d", p, u2);
+			if(ofs.fail())
+				ErrorMsg("Cannot create the " + filePath + " file, the program will terminate.");
+
+			OutputBuffer out(&ofs);
+			size_t n = convreq_.size(), i, t;
+			if(!threads) threads = std::max(1u, std::thread::hardware_concurrency());
+			if(threads > n / MinRequestsPerThread) threads = static_cast<unsigned>(n / MinRequestsPerThread);
+			if(threads <= 1) {
+				for(i = 0; i < n; ++i) WriteResult(out, convreq_[i]);
+				return;
+			}
+
+			//the graph and its index are only read by the threads
+			std::vector<OutputBuffer> parts(threads);
+			std::vector<std::thread> pool;
+			for(t = 0; t < threads; ++t)
+				pool.push_back(std::thread([this, &parts, t, n, threads]() {
+					for(size_t j = n * t / threads, last = n * (t + 1) / threads; j < last; ++j)
+						WriteResult(parts[t], convreq_[j]);
+				}));
+			for(t = 0; t < threads; ++t) {
+				pool[t].join();
+				out.Append(parts[t].GetData());
+			}
+		}
+
+		//Convert the requests of an input file as they are read, without buffering them,
+		//each request is served by the rules which precede it in the file, the factors
+		//are taken from the memoized path search, so no index is built for the whole graph
+		void Convert(const std::string &inFile, const std::string &outFile) {
+			double f;
+			Request req;
+			std::string_view s, units[2];
+			units_.MakeEmpty();
+			digraph_.MakeEmpty();
+			convreq_.clear();
+
+			LineReader in(inFile);
+			if(!in.IsOpen())
+				ErrorMsg("Cannot open the " + inFile + " file, the program will terminate.");
+			std::ofstream ofs(outFile.c_str());
+			if(ofs.fail())
+				ErrorMsg("Cannot create the " + outFile + " file, the program will terminate.");
+
+			OutputBuffer out(&ofs);
+			while(in.GetLine(s))
+				if(ParseLine(s, req, units))
+					WriteResult(out, req, IsValid(req) && digraph_.GetPathFactor(req.from, req.to, f) ? &f : 0);
+		}
+
+		//Add a conversion rule (v1 u1 = v2 u2) or update the existing one of the same units,
+		//the precomputed factors and the cache are updated for the affected components only
+		bool SetRule(std::string_view u1, double v1, std::string_view u2, double v2) {
+			if(!(0.0 < v1) || !(0.0 < v2)) return false;
+			if(!digraph_.IsIndexed()) digraph_.BuildIndex();
+			Digraph::Vertex rid1 = AddUnit(u1);
+			Digraph::Vertex rid2 = AddUnit(u2);
+			digraph_.SetRatio(rid1, rid2, v2/v1);
+			return true;
+		}
+		//Remove the conversion rule of 2 units, false is returned if there is no such rule
+		bool RemoveRule(std::string_view u1, std::string_view u2) {
+			UnitTable::Id rid1 = units_.Find(u1);
+			UnitTable::Id rid2 = units_.Find(u2);
+			if(rid1 == UnitTable::NoId || rid2 == UnitTable::NoId) return false;
+			if(!digraph_.IsIndexed()) digraph_.BuildIndex();
+			return digraph_.RemoveRatio(rid1, rid2);
+		}
+		//Convert a value from one unit to another using the current rules
+		bool ConvertValue(double value, std::string_view from, std::string_view to, double &result) {
+			double f;
+			Request req;
+			if((req.from = units_.Find(from)) == UnitTable::NoId || (req.to = units_.Find(to)) == UnitTable::NoId) return false;
+			if(!digraph_.IsIndexed()) digraph_.BuildIndex();
+			req.value = value;
+			if(!IsValid(req) || !digraph_.GetFactor(req.from, req.to, f)) return false;
+			result = value * f;
+			return true;
+		}
+
+		//Id of a unit for the bulk conversions, the ids of the units stay the same while the rules change
+		typedef UnitTable::Id UnitId;
+		static constexpr UnitId NoUnit = UnitTable::NoId;
+		//Conversion of a value from one unit to another
+		struct Conversion {
+			double value;
+			UnitId from, to;
+		};
+		//Get the id of a unit, NoUnit is returned if the unit is unknown
+		UnitId GetUnitId(std::string_view name) const {return units_.Find(name);}
+
+		//Convert n values from one unit to another, the factor is resolved once and the values are scaled
+		//by the vectorized kernel (src and dst may be the same array), false is returned if no conversion is possible
+		bool ConvertValues(UnitId from, UnitId to, const double *src, double *dst, std::size_t n) {
+			double f;
+			if(!GetFactor(from, to, f)) return false;
+			Scale(src, dst, n, f);
+			return true;
+		}
+		bool ConvertValues(std::string_view from, std::string_view to, const double *src, double *dst, std::size_t n) {
+			return ConvertValues(units_.Find(from), units_.Find(to), src, dst, n);
+		}
+		//Convert n values given with their units into the results, the factor is resolved once per run of 
+		//the same units (the conversions grouped by the units take the fewest lookups), the results
+		//of the impossible conversions are NaN, the number of the converted values is returned
+		std::size_t ConvertValues(const Conversion *conv, std::size_t n, double *results) {
+			std::size_t converted = 0, i, j;
+			double f;
+			for(i = 0; i < n; i = j) {
+				for(j = i + 1; j < n && conv[j].from == conv[i].from && conv[j].to == conv[i].to; ++j);
+				if(!GetFactor(conv[i].from, conv[i].to, f)) {
+					std::fill(results + i, results + j, std::numeric_limits<double>::quiet_NaN());
+					continue;
 				}
+				Scale(conv + i, results + i, j - i, f);
+				converted += j - i;
+			}
+			return converted;
+		}
+
+		//Get hit/miss counters of the path factors cache used while streaming
+		const Digraph::CacheStats &GetCacheStats() const {return digraph_.GetCacheStats();}
+
+		//shows an error message and quits
+		static void ErrorMsg(const std::string &msg) {
+			std::cout << msg << std::endl;
+			std::system("pause");
+			exit(1);
+		}
+	private:
+		//Get the factor of the conversion of 2 units from the index (it is built if it is out of date)
+		bool GetFactor(UnitId from, UnitId to, double &f) {
+			if(units_.GetCount() <= from || units_.GetCount() <= to) return false;
+			if(!digraph_.IsIndexed()) digraph_.BuildIndex();
+			return digraph_.HasArcs(from) && digraph_.HasArcs(to) && digraph_.GetFactor(from, to, f);
+		}
+		//Multiply n values by the factor, with AVX2 16 values are scaled per iteration by 4 independent 
+		//vectors, the remainder (and the whole array without AVX2) is left to the scalar loop;
+		//the results are the same as of the scalar multiplication
+		static void Scale(const double *src, double *dst, std::size_t n, double f) {
+			std::size_t i = 0;
+#ifdef __AVX2__
+			__m256d vf = _mm256_set1_pd(f);
+			for(; i + 16 <= n; i += 16) {
+				__m256d a = _mm256_loadu_pd(src + i), b = _mm256_loadu_pd(src + i + 4);
+				__m256d c = _mm256_loadu_pd(src + i + 8), d = _mm256_loadu_pd(src + i + 12);
+				_mm256_storeu_pd(dst + i, _mm256_mul_pd(a, vf));
+				_mm256_storeu_pd(dst + i + 4, _mm256_mul_pd(b, vf));
+				_mm256_storeu_pd(dst + i + 8, _mm256_mul_pd(c, vf));
+				_mm256_storeu_pd(dst + i + 12, _mm256_mul_pd(d, vf));
 			}
+			for(; i + 4 <= n; i += 4) _mm256_storeu_pd(dst + i, _mm256_mul_pd(_mm256_loadu_pd(src + i), vf));
+#endif
+			for(; i < n; ++i) dst[i] = src[i] * f;
+		}
+		//Multiply the values of n conversions by the factor, with AVX2 the values are gathered 
+		//from 4 conversions at a time (they are a fixed number of doubles apart)
+		static void Scale(const Conversion *conv, double *dst, std::size_t n, double f) {
+			std::size_t i = 0;
+#ifdef __AVX2__
+			static_assert(sizeof(Conversion) % sizeof(double) == 0 && offsetof(Conversion, value) == 0, "Conversion is not a whole number of doubles");
+			const long long stride = sizeof(Conversion) / sizeof(double);
+			__m256i idx = _mm256_set_epi64x(3 * stride, 2 * stride, stride, 0);
+			__m256d vf = _mm256_set1_pd(f);
+			for(; i + 4 <= n; i += 4)
+				_mm256_storeu_pd(dst + i, _mm256_mul_pd(_mm256_i64gather_pd(&conv[i].value, idx, 8), vf));
+#endif
+			for(; i < n; ++i) dst[i] = conv[i].value * f;
 		}
 };
 